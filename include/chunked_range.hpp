@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/**
+ * @file chunked_range.hpp
+ * This file defines a range request that is split into time slices so
+ * that only a few slices of a long history are held in memory at once.
+ */
+
+#ifndef __CHUNKED_RANGE_HPP__
+#define __CHUNKED_RANGE_HPP__
+
+#include "client_world_connection.hpp"
+
+#include <cstddef>
+#include <deque>
+#include <exception>
+
+/**
+ * A range request over [start, stop) that is sent as consecutive range
+ * requests of at most @slice milliseconds each. At most @max_in_flight
+ * slices are requested or buffered at once and they are returned in time
+ * order, so peak memory depends on the slice size rather than the length
+ * of the whole range.
+ * This class is not thread safe; read it from one thread.
+ */
+class ChunkedRangeResponse {
+  private:
+    ClientWorldConnection& cwc;
+    world_model::client::Request request;
+    world_model::grail_time slice;
+    size_t max_in_flight;
+    ///Start of the next slice to request
+    world_model::grail_time next_start;
+    ///Slices that were requested but not yet read, oldest first
+    std::deque<Response> pending;
+
+    ///Request slices until max_in_flight are pending or the range is covered
+    void fill();
+
+    ChunkedRangeResponse& operator=(const ChunkedRangeResponse&) = delete;
+    ChunkedRangeResponse(const ChunkedRangeResponse&) = delete;
+  public:
+    /**
+     * Start requesting the range in @request. A stop time of 0 means the
+     * current time. Throws std::invalid_argument if @slice or
+     * @max_in_flight is 0.
+     */
+    ChunkedRangeResponse(ClientWorldConnection& cwc, const world_model::client::Request& request,
+        world_model::grail_time slice, size_t max_in_flight = 2);
+
+    /// Move constructor
+    ChunkedRangeResponse(ChunkedRangeResponse&& other);
+
+    /**
+     * Get the changes in the next slice, blocking until they arrive, and
+     * request another slice in its place. Slices with no changes return an
+     * empty state, so use isComplete() to find the end of the range.
+     * Throws if the slice failed, and returns an empty state once every
+     * slice was read.
+     */
+    world_model::WorldState next();
+
+    ///Returns true if a call to next() will not block.
+    bool hasNext();
+
+    /**
+     * Returns true if the next slice had an error and a call to next()
+     * would throw an exception.
+     */
+    bool isError();
+
+    ///Returns any error associated with the next slice.
+    std::exception getError();
+
+    ///True once every slice of the range was read.
+    bool isComplete();
+};
+
+#endif
+
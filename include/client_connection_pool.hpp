@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/**
+ * @file client_connection_pool.hpp
+ * This file defines a set of client connections to the same world model so
+ * that large requests do not delay small ones queued behind them on a
+ * single socket.
+ */
+
+#ifndef __CLIENT_CONNECTION_POOL_HPP__
+#define __CLIENT_CONNECTION_POOL_HPP__
+
+#include "client_world_connection.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Several ClientWorldConnections to one world model, each with its own
+ * socket and receive thread. The first connection is reserved for
+ * interactive requests. Bulk requests go to the other connection with the
+ * fewest pending snapshot and range requests. Interactive requests use the
+ * first connection unless another one has nothing pending, so they never
+ * wait behind a large result. Streams do not count as load.
+ * This class is thread safe.
+ */
+class ClientConnectionPool {
+  public:
+    ///How a request is routed
+    enum class Priority : uint8_t {
+      ///Latency sensitive, may use any connection
+      interactive,
+      ///Large or slow, kept off the first connection when there are others
+      bulk
+    };
+
+  private:
+    std::vector<std::unique_ptr<ClientWorldConnection>> connections;
+
+    ClientConnectionPool& operator=(const ClientConnectionPool&) = delete;
+    ClientConnectionPool(const ClientConnectionPool&) = delete;
+  public:
+    /**
+     * Open @size connections to the world model.
+     * Throws std::invalid_argument if @size is 0.
+     */
+    ClientConnectionPool(const std::string& ip, uint16_t port, size_t size);
+
+    ///Number of connections in the pool
+    size_t size() const;
+
+    /**
+     * The connection that the next request of the given priority would use,
+     * for classes such as LocalView and ChunkedRangeResponse that take a
+     * ClientWorldConnection. Connected connections are preferred.
+     */
+    ClientWorldConnection& connection(Priority priority = Priority::interactive);
+
+    /**
+     * Reconnect any connection that was lost.
+     * Returns true if every connection is connected afterwards.
+     */
+    bool reconnect();
+
+    ///Returns true if at least one connection is connected.
+    bool connected();
+
+    ///Set the snapshot cache size of every connection.
+    void setSnapshotCache(size_t max_bytes);
+
+    /**
+     * The requests of ClientWorldConnection, routed to one connection of
+     * the pool. Responses stay tied to the connection that serves them.
+     * Range requests default to bulk and the others to interactive.
+     */
+    Response currentSnapshotRequest(const world_model::URI&, const std::vector<std::u16string>&,
+        Priority priority = Priority::interactive);
+    Response currentSnapshotRequest(const world_model::URI&, const std::vector<std::u16string>&,
+        world_model::grail_time max_age, Priority priority = Priority::interactive);
+    Response snapshotRequest(const world_model::client::Request& request,
+        Priority priority = Priority::interactive);
+    Response rangeRequest(const world_model::client::Request& request,
+        Priority priority = Priority::bulk);
+    Response snapshotRequest(const world_model::client::Request& request,
+        ClientWorldConnection::URIVisitor visitor, Priority priority = Priority::interactive);
+    Response rangeRequest(const world_model::client::Request& request,
+        ClientWorldConnection::URIVisitor visitor, Priority priority = Priority::bulk);
+    StepResponse streamRequest(const world_model::URI&, const std::vector<std::u16string>&, uint64_t,
+        Priority priority = Priority::interactive);
+    StepResponse streamRequest(const world_model::URI&, const std::vector<std::u16string>&, uint64_t,
+        ClientWorldConnection::URIVisitor callback,
+        ClientWorldConnection::Executor executor = ClientWorldConnection::Executor(),
+        Priority priority = Priority::interactive);
+};
+
+#endif
+
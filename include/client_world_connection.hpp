@@ -31,23 +31,33 @@
 #include <owl/simple_sockets.hpp>
 #include <owl/world_model_protocol.hpp>
 
+#include "spsc_queue.hpp"
+
 #include <functional>
 #include <future>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <queue>
+#include <unordered_map>
+#include <vector>
 
 //Forward declaration for Response and StepResponse
 class ClientWorldConnection;
 
 ///Response of a client request to the world model
 class Response {
+  public:
+    ///A result that may be shared by several identical requests
+    typedef std::shared_ptr<const world_model::WorldState> SharedState;
+
   private:
-    std::future<world_model::WorldState> data;
+    std::shared_future<SharedState> data;
     uint64_t request_key;
 
     //The client world connection that is servicing the request
@@ -59,7 +69,7 @@ class Response {
     /**
      * Create a new future response object for a request.
      */
-    Response(std::future<world_model::WorldState>&& data, ClientWorldConnection& cwc, uint64_t key) : data(std::move(data)), cwc(cwc) {
+    Response(std::shared_future<SharedState> data, ClientWorldConnection& cwc, uint64_t key) : data(data), cwc(cwc) {
       request_key = key;
     }
 
@@ -72,10 +82,19 @@ class Response {
     }
 
     /**
-     * Get new data. Blocks if new data has not arrived yet.
+     * Get new data. Blocks if new data has not arrived yet. A result that
+     * nothing else shares is moved out rather than copied, so a later call
+     * to get() or getShared() returns an empty state; call getShared()
+     * first to read the result more than once.
      */
     world_model::WorldState get();
 
+    /**
+     * Get the result without copying it. Identical requests that were in
+     * flight at the same time share the same result.
+     */
+    SharedState getShared();
+
     ///True if a call to get() will not block
     bool ready();
 
@@ -93,8 +112,12 @@ class Response {
 
 ///Multipart response of a client streaming request to the world model
 class StepResponse {
+  public:
+    ///Channel from the receive thread to this response
+    typedef SPSCQueue<world_model::WorldState> UpdateQueue;
+
   private:
-    std::future<world_model::WorldState> data;
+    std::shared_ptr<UpdateQueue> updates;
     uint64_t request_key;
 
     //The client world connection that is servicing the request
@@ -106,7 +129,7 @@ class StepResponse {
     /**
      * Create a step response object to service streaming requests.
      */
-    StepResponse(std::future<world_model::WorldState>&& data, ClientWorldConnection& cwc, uint64_t key) : data(std::move(data)), cwc(cwc) {
+    StepResponse(std::shared_ptr<UpdateQueue> updates, ClientWorldConnection& cwc, uint64_t key) : updates(updates), cwc(cwc) {
       request_key = key;
     }
 
@@ -114,14 +137,33 @@ class StepResponse {
     ~StepResponse();
 
     /// Move constructor
-    StepResponse(StepResponse&& other) : data(std::move(other.data)), cwc(other.cwc) {
+    StepResponse(StepResponse&& other) : updates(std::move(other.updates)), cwc(other.cwc) {
       request_key = other.request_key;
     }
 
-    ///Get the next data set or block until it is available and then return it.
+    /**
+     * Get the next data set or block until it is available and then return it.
+     * Returns an empty state once the request is complete and throws if the
+     * request failed.
+     */
     world_model::WorldState next();
 
-    ///Returns true if a call to next() will not block. (TODO FIXME Returns true if there is no error -- documentation problem?)
+    /**
+     * Block until at least one update is available, then return it merged
+     * with every other update that has already arrived. Later values of an
+     * attribute (same name and origin) replace earlier ones. Returns an
+     * empty state once the request is complete.
+     */
+    world_model::WorldState nextBatch();
+
+    /**
+     * Append every update that has already arrived to @out without
+     * blocking and return how many were added. Throws if the request failed
+     * and no updates are left.
+     */
+    size_t drain(std::vector<world_model::WorldState>& out);
+
+    ///Returns true if a call to next() will not block.
     bool hasNext();
 
     /**
@@ -136,8 +178,11 @@ class StepResponse {
      */
     std::exception getError();
 
-    ///True if this streaming request is complete.
+    ///True if this streaming request is complete and every update was read.
     bool isComplete();
+
+    ///Cancel the streaming request. Updates already queued can still be read.
+    void cancel();
 };
 
 /**
@@ -146,22 +191,31 @@ class StepResponse {
  * This class is thread safe.
  */
 class ClientWorldConnection {
+  public:
+    /**
+     * Called with one URI and its attributes as the data for a request
+     * arrives, instead of collecting the whole result in memory.
+     */
+    typedef std::function<void (const world_model::URI& uri, const std::vector<world_model::Attribute>& attributes)> URIVisitor;
+
+    ///Runs a task, for instance by queueing it to a thread pool
+    typedef std::function<void (std::function<void ()>)> Executor;
+
+    ///Counters for the current snapshot cache
+    struct CacheStatistics {
+      uint64_t hits;
+      uint64_t misses;
+      ///Estimated memory used by the cached results
+      size_t bytes;
+      size_t entries;
+    };
+
+  private:
     //Allow Response and StepResponse to notify the ClientWorldConnection
     //if they are no longer required
     friend class Response;
     friend class StepResponse;
   protected:
-    ///See if a request is still being serviced (only for StepResponse)
-    bool isComplete(uint32_t key);
-    /**
-     * getNextFuture should only be called if hasNextFuture is true, otherwise
-     * the future will be given an exception.
-     * Streaming requests will have multiple futures while other
-     * requests will only have a single future.
-     */
-    bool hasNextFuture(uint32_t key);
-    ///Get the future for the request associated with @key
-    std::future<world_model::WorldState> getNextFuture(uint32_t key);
     ///Check for an error with the request associated with @key
     bool hasError(uint32_t key);
     ///Get error (will return std::exception("No error") is there is none
@@ -171,26 +225,74 @@ class ClientWorldConnection {
      * associated with this request
      */
     void markFinished(uint32_t key);
+    ///Stop delivering updates for a request and ask the world model to cancel it
+    void cancelRequest(uint32_t key);
+    /**
+     * True the first time it is called for a completed request whose result
+     * has exactly one Response and was not cached, so it may be moved out.
+     */
+    bool claimResult(uint32_t key);
   private:
-    //Lock this before changing cur_key, errors, promises, or step_promises
+    //Lock this before changing cur_key, errors, promises, or streams
     std::mutex promise_mutex;
     //TODO When gcc supports atomic_fast_uint32_t then switch to that
     //Remember which key is being assigned.
     uint32_t cur_key;
     //Map of errors for different response keys.
     std::map<uint64_t, std::exception> errors;
-    //Promises to Responses and StepResponses
-    //TODO FIXME The current versions of gcc have not implemented
-    //the emplace operator for maps. I'm going to use pointers in here.
-    std::map<uint64_t, std::queue<std::promise<world_model::WorldState>*>> step_promises;
-    //Remember which promises are for non-StepResponses
-    std::set<uint64_t> single_response;
+    //Promises to Responses, removed once they are fulfilled
+    std::map<uint64_t, std::unique_ptr<std::promise<Response::SharedState>>> promises;
+    ///Identifies identical snapshot (false) and range (true) requests
+    typedef std::tuple<bool, world_model::URI, std::vector<std::u16string>, world_model::grail_time, world_model::grail_time> RequestKey;
+    ///A request that later identical requests can attach to
+    struct InFlight {
+      RequestKey key;
+      std::shared_future<Response::SharedState> result;
+      ///Number of Responses waiting for this ticket
+      size_t holders;
+      ///When the request was sent, used to age cached results
+      world_model::grail_time issued;
+    };
+    std::map<RequestKey, uint64_t> in_flight_tickets;
+    std::map<uint64_t, InFlight> in_flight;
+    ///Completed requests whose result is not shared, see claimResult
+    std::set<uint64_t> exclusive_results;
+    ///Stop attaching new requests to a ticket. Call with promise_mutex locked.
+    void endInFlight(uint64_t key);
+    ///Send a snapshot or range request, attaching to an identical one in flight
+    Response coalescedRequest(bool range, const world_model::client::Request& request);
+
+    ///Current snapshot results by URI and attribute patterns
+    typedef std::pair<world_model::URI, std::vector<std::u16string>> CacheKey;
+    struct CachedSnapshot {
+      Response::SharedState state;
+      world_model::grail_time fetched;
+      size_t bytes;
+      std::list<CacheKey>::iterator recent;
+    };
+    /**
+     * The snapshot cache and its LRU order, most recently used first.
+     * Protected by promise_mutex.
+     */
+    std::map<CacheKey, CachedSnapshot> snapshot_cache;
+    std::list<CacheKey> cache_order;
+    ///Memory limit of the cache, 0 when caching is off
+    size_t cache_limit;
+    size_t cache_bytes;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    ///Store a completed current snapshot. Call with promise_mutex locked.
+    void cacheSnapshot(const CacheKey& key, Response::SharedState state, world_model::grail_time fetched);
+    //Update queues of StepResponses. The receive thread is the only producer.
+    std::map<uint64_t, std::shared_ptr<StepResponse::UpdateQueue>> streams;
     //Partial results that must be completed before fulfilling a promise
     std::map<uint64_t, world_model::WorldState> partial_results;
+    //Visitors that receive the data of a request instead of partial_results
+    std::map<uint64_t, std::shared_ptr<URIVisitor>> visitors;
 
     void setError(uint32_t key, const std::string& error);
-    std::future<world_model::WorldState> makePromise(uint32_t key);
-    std::future<world_model::WorldState> makeStepPromise(uint32_t key);
+    std::shared_future<Response::SharedState> makePromise(uint32_t key);
+    std::shared_ptr<StepResponse::UpdateQueue> makeStream(uint32_t key);
 
     //This mutex should be locked before sending data out through the socket
     std::mutex out_mutex;
@@ -198,8 +300,22 @@ class ClientWorldConnection {
     MessageReceiver ss;
     std::string ip;
     uint16_t port;
-    std::map<uint32_t, std::u16string> known_attributes;
-    std::map<uint32_t, std::u16string> known_origins;
+    /**
+     * Names indexed by their alias. Aliases are normally assigned in
+     * order and stored densely. An alias far beyond the known ones is kept
+     * in a map instead so that one bad alias cannot force a huge table.
+     */
+    struct AliasTable {
+      std::vector<std::u16string> dense;
+      std::unordered_map<uint32_t, std::u16string> sparse;
+    };
+    ///Attribute and origin names. Only the receive thread uses these tables.
+    AliasTable known_attributes;
+    AliasTable known_origins;
+    ///Store the name for an alias in one of the alias tables
+    void setAlias(AliasTable& table, uint32_t alias, const std::u16string& name);
+    ///The name for an alias, or an empty name if the alias is unknown
+    static const std::u16string& aliasName(const AliasTable& table, uint32_t alias);
     bool interrupted;
 
     void receiveThread();
@@ -228,6 +344,23 @@ class ClientWorldConnection {
      */
     Response currentSnapshotRequest(const world_model::URI&, const std::vector<std::u16string>&);
 
+    /**
+     * Like currentSnapshotRequest but answered from the snapshot cache if
+     * the cached result was requested at most @max_age milliseconds ago.
+     * Without a cache this is the same as currentSnapshotRequest.
+     */
+    Response currentSnapshotRequest(const world_model::URI&, const std::vector<std::u16string>&, world_model::grail_time max_age);
+
+    /**
+     * Cache the results of current snapshot requests in up to @max_bytes
+     * of memory, evicting the least recently used results first. A size of
+     * 0 turns the cache off and empties it.
+     */
+    void setSnapshotCache(size_t max_bytes);
+
+    ///Return the hit and miss counts and the size of the snapshot cache.
+    CacheStatistics snapshotCacheStatistics();
+
     /**
      * Returns information about the state of any URIs matching the
      * URI REGEX expression and any attributes matching any of the
@@ -246,6 +379,16 @@ class ClientWorldConnection {
      */
     Response rangeRequest(const world_model::client::Request& request);
 
+    /**
+     * Snapshot and range requests that hand each URI to @visitor as soon as
+     * it arrives so that memory use does not grow with the size of the
+     * result. The visitor runs on the receive thread and should return
+     * quickly. The Response completes with an empty state after the last
+     * call to the visitor, or with an error if the visitor throws.
+     */
+    Response snapshotRequest(const world_model::client::Request& request, URIVisitor visitor);
+    Response rangeRequest(const world_model::client::Request& request, URIVisitor visitor);
+
     /**
      * Returns information about the state of any URIs matching the
      * URI REGEX expression and any attributes matching any of the
@@ -258,11 +401,27 @@ class ClientWorldConnection {
      */
     StepResponse streamRequest(const world_model::URI&, const std::vector<std::u16string>&, uint64_t);
 
+    /**
+     * Stream updates to @callback instead of queueing them for next(). The
+     * callback runs on the receive thread, or is handed to @executor with a
+     * copy of the update if one is given; an executor with several threads
+     * may run updates out of order. The returned StepResponse reports
+     * completion and errors, and cancels the stream when it is destroyed.
+     */
+    StepResponse streamRequest(const world_model::URI&, const std::vector<std::u16string>&, uint64_t,
+        URIVisitor callback, Executor executor = Executor());
+
     /**
      * Returns true if this instance is connected to the world model,
      * false otherwise.
      */
     bool connected();
+
+    /**
+     * Number of snapshot and range requests that are still waiting for
+     * their data. Streams are not included since they are mostly idle.
+     */
+    size_t pendingResponses();
 };
 
 #endif
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/**
+ * @file local_view.hpp
+ * This file defines a local copy of part of the world model that is kept
+ * current by a stream request so that repeated reads do not need a round
+ * trip to the world model.
+ */
+
+#ifndef __LOCAL_VIEW_HPP__
+#define __LOCAL_VIEW_HPP__
+
+#include "client_world_connection.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * The state of the URIs and attributes matching a request, seeded by a
+ * snapshot and updated by a stream on the same patterns.
+ * This class is thread safe.
+ */
+class LocalView {
+  public:
+    ///The attributes of one URI and when they last changed
+    struct Value {
+      std::vector<world_model::Attribute> attributes;
+      ///Value of version() after the last update to this URI
+      uint64_t version;
+      ///Latest creation date of the attributes
+      world_model::grail_time updated;
+    };
+
+  private:
+    ///URIs are spread over this many independently locked maps
+    static const size_t num_stripes = 16;
+
+    struct Stripe {
+      std::mutex mutex;
+      std::unordered_map<world_model::URI, Value> values;
+      /**
+       * Attributes that expired while the seed was arriving, without their
+       * data. An older value from the seed must not bring them back.
+       */
+      std::unordered_map<world_model::URI, std::vector<world_model::Attribute>> expired;
+    };
+
+    /**
+     * Shared with the callbacks of the requests so that an update that is
+     * being applied while the view is destroyed stays valid.
+     */
+    struct Index {
+      Stripe stripes[num_stripes];
+      std::atomic<uint64_t> version;
+      ///True until the seed has arrived, while expirations are remembered
+      std::atomic<bool> seeding;
+
+      Index() : version(0), seeding(true) {}
+      Stripe& stripeFor(const world_model::URI& uri);
+      ///Merge attributes into a URI, keeping the newest value of each
+      void apply(const world_model::URI& uri, const std::vector<world_model::Attribute>& attributes);
+      ///Stop remembering expirations and drop the ones kept so far
+      void endSeed();
+    };
+
+    std::shared_ptr<Index> index;
+    ///Keeps the view current. Started before the seed so nothing is missed.
+    StepResponse updates;
+    ///Snapshot that fills the view initially
+    Response seed;
+    ///Call endSeed once the seed has arrived
+    void checkSeed();
+
+    LocalView& operator=(const LocalView&) = delete;
+    LocalView(const LocalView&) = delete;
+  public:
+    /**
+     * Start following the URIs matching @uri and attributes matching
+     * @attributes. Updates are requested at the given interval.
+     */
+    LocalView(ClientWorldConnection& cwc, const world_model::URI& uri,
+        const std::vector<std::u16string>& attributes, uint64_t interval = 0);
+
+    ///True once the seed snapshot has arrived.
+    bool ready();
+
+    ///True if either the snapshot or the stream failed.
+    bool isError();
+
+    /**
+     * Copy the current value of a URI into @value.
+     * Returns false if the URI is not in the view.
+     */
+    bool lookup(const world_model::URI& uri, Value& value);
+
+    ///Copy of every URI in the view
+    world_model::WorldState snapshot();
+
+    ///Number of updates applied so far
+    uint64_t version();
+
+    ///Number of URIs in the view
+    size_t size();
+};
+
+#endif
+
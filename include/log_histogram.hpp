@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/**
+ * @file log_histogram.hpp
+ * This file defines a histogram with logarithmically sized buckets, in the
+ * style of an HDR histogram, that can be updated from several threads
+ * without locking.
+ */
+
+#ifndef __LOG_HISTOGRAM_HPP__
+#define __LOG_HISTOGRAM_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Histogram of 64 bit values. Every power of two is split into 16 buckets
+ * so values are recorded with a relative error of at most 1/16.
+ * Recording and taking snapshots never block.
+ */
+class LogHistogram {
+  public:
+    ///Each power of two is split into 2^sub_bits buckets
+    static const int sub_bits = 4;
+    static const size_t sub_buckets = 1 << sub_bits;
+    static const size_t num_buckets = (64 - sub_bits + 1) * sub_buckets;
+
+    ///A copy of a histogram's counters at one point in time.
+    struct Snapshot {
+      std::vector<uint64_t> counts;
+      ///Number of recorded values
+      uint64_t count;
+      uint64_t sum;
+      uint64_t max;
+
+      ///Mean of the recorded values, or 0 if there are none.
+      double mean() const;
+
+      /**
+       * Smallest value that is at least the given fraction (from 0 to 1)
+       * of the recorded values, to the precision of the buckets.
+       */
+      uint64_t percentile(double fraction) const;
+    };
+
+  private:
+    std::atomic<uint64_t> counts[num_buckets];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+
+    LogHistogram& operator=(const LogHistogram&) = delete;
+    LogHistogram(const LogHistogram&) = delete;
+  public:
+    LogHistogram();
+
+    ///Bucket that holds a value
+    static size_t bucketFor(uint64_t value);
+    ///Largest value that falls into a bucket
+    static uint64_t bucketLimit(size_t bucket);
+
+    void record(uint64_t value);
+
+    Snapshot snapshot() const;
+};
+
+#endif
+
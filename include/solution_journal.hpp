@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/**
+ * @file solution_journal.hpp
+ * This file defines an append-only journal of encoded solver messages.
+ * Messages are written into memory mapped segment files before they are sent
+ * to the world model and released once the socket accepts them so that
+ * unsent solutions survive a restart of the solver process.
+ */
+
+#ifndef __SOLUTION_JOURNAL_HPP__
+#define __SOLUTION_JOURNAL_HPP__
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/uio.h>
+
+/**
+ * Journal of messages that have not been sent to the world model yet.
+ * Each record is stored with a checksum so that a partially written record
+ * at the end of a segment is ignored during replay.
+ * This class is thread safe.
+ */
+class SolutionJournal {
+  public:
+    ///Identifies a journaled message so that it can be released once sent.
+    typedef uint64_t RecordID;
+
+    ///Data needed to interpret messages, shared by the records that used it
+    typedef std::shared_ptr<const std::vector<unsigned char>> Context;
+
+    ///A message that was journaled but never released
+    struct UnsentRecord {
+      RecordID id;
+      std::vector<unsigned char> message;
+      ///The context that was set when the message was appended, or null
+      Context context;
+    };
+
+  private:
+    ///A memory mapped segment file
+    struct Segment {
+      uint32_t index;
+      int fd;
+      unsigned char* base;
+      size_t size;
+      size_t write_offset;
+      ///Number of records in this segment that have not been released
+      size_t outstanding;
+      ///True if the segment was modified since the last commit
+      bool dirty;
+      ///True once the current context was written to this segment
+      bool has_context;
+    };
+
+    std::string directory;
+    size_t segment_size;
+    ///Segments ordered from oldest to newest. New records go to the back.
+    std::deque<Segment> segments;
+    ///Index of the next segment file to create
+    uint32_t next_index;
+    ///Segments created by append since the journal was opened
+    uint64_t segments_created;
+    ///True if the journal directory could be opened
+    bool valid;
+    ///Context written ahead of the records that are appended after it
+    std::vector<unsigned char> context;
+    std::mutex journal_mutex;
+
+    std::string segmentPath(uint32_t index) const;
+    ///Map a segment file, creating it if it does not exist yet.
+    bool mapSegment(uint32_t index, size_t min_size, Segment& seg);
+    ///Unmap a segment and optionally remove its file.
+    void closeSegment(Segment& seg, bool remove);
+    /**
+     * Scan the valid records of a segment. Unsent records are appended to
+     * @unsent, along with the context that precedes them, if it is not null.
+     */
+    void scanSegment(Segment& seg, std::vector<UnsentRecord>* unsent);
+    ///The newest segment, replaced by a new one if @needed bytes do not fit.
+    Segment& segmentFor(size_t needed);
+    ///Write a record with the given state at the end of a segment.
+    RecordID writeRecord(Segment& seg, const struct iovec* pieces, size_t count, uint32_t state);
+    ///Move the read offset past released records and drop finished segments.
+    void advance(std::deque<Segment>::iterator seg);
+
+    SolutionJournal& operator=(const SolutionJournal&) = delete;
+    SolutionJournal(const SolutionJournal&) = delete;
+  public:
+    /**
+     * Open (or create) a journal in the given directory. Any records left
+     * over from a previous process are available through unsent().
+     */
+    SolutionJournal(const std::string& directory, size_t segment_size = 4*1024*1024);
+
+    ~SolutionJournal();
+
+    ///True if the journal was opened successfully.
+    operator bool() const;
+
+    ///Records that were journaled but never released, oldest first.
+    std::vector<UnsentRecord> unsent();
+
+    /**
+     * Set the context needed to interpret the messages appended after this
+     * call, such as a table of type aliases. The context is written into
+     * each segment ahead of the first message that depends on it and is
+     * returned with those messages by unsent().
+     */
+    void setContext(const std::vector<unsigned char>& context);
+
+    /**
+     * Add a message to the journal. The message survives a process restart
+     * as soon as this returns. Call commit after a batch of appends to
+     * schedule the dirty pages for writeback. Segment space is reserved
+     * when a segment is created, so a full disk makes this throw
+     * std::runtime_error rather than fault while writing.
+     */
+    RecordID append(const std::vector<unsigned char>& message);
+
+    ///Add a message that is given as a gather list.
+    RecordID append(const struct iovec* pieces, size_t count);
+
+    /**
+     * Flush appended records to disk. Without @wait the writeback is only
+     * scheduled, which keeps group commit cheap.
+     */
+    void commit(bool wait = false);
+
+    ///Mark a record as sent so that it is not replayed.
+    void release(RecordID id);
+
+    ///Number of records that have not been released.
+    size_t pending();
+
+    ///Number of segments that append had to create to fit new records.
+    uint64_t segmentsCreated();
+};
+
+#endif
+
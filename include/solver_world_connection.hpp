@@ -35,15 +35,25 @@
 #include <owl/simple_sockets.hpp>
 #include <owl/world_model_protocol.hpp>
 
+#include "log_histogram.hpp"
+#include "solution_journal.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
 #include <set>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <regex.h>
 
 /**
@@ -51,6 +61,12 @@
  */
 class SolverWorldModel {
   public:
+    ///The address and port of a world model
+    typedef std::pair<std::string, uint16_t> Endpoint;
+
+    ///Progress of the background connection to the world model
+    enum class ConnectionState : uint8_t { disconnected, connecting, handshaking, connected, backoff };
+
     ///An attribute update
     struct AttrUpdate {
       std::u16string type;
@@ -59,28 +75,109 @@ class SolverWorldModel {
       std::vector<uint8_t> data;
     };
 
+    /**
+     * Opaque handle for a solution type. Handles are returned by addTypes
+     * and typeHandle and make type lookups in sendData an array index.
+     */
+    typedef uint32_t TypeHandle;
+
+    ///An attribute update that names its type with a TypeHandle
+    struct HandleUpdate {
+      TypeHandle type;
+      world_model::grail_time time;
+      world_model::URI target;
+      std::vector<uint8_t> data;
+    };
+
+    /**
+     * Distributions of the costs on the send path. Times are in nanoseconds.
+     */
+    struct SendStatistics {
+      ///Time spent waiting to lock send_mutex
+      LogHistogram::Snapshot lock_wait;
+      ///Time spent encoding solution messages
+      LogHistogram::Snapshot encode;
+      ///Time spent writing messages to the socket
+      LogHistogram::Snapshot socket_write;
+      ///Total time of sends that had to be retried, including reconnecting
+      LogHistogram::Snapshot retry;
+      ///Size of each message in bytes
+      LogHistogram::Snapshot message_bytes;
+    };
+
+    /**
+     * Callback for changes to the on_demand requests of a type. It receives
+     * the type name and the URI patterns that are currently requested; an
+     * empty list means that nobody is listening to that type.
+     */
+    typedef std::function<void (const std::u16string& type, const std::vector<std::u16string>& requests)> OnDemandCallback;
+
+    ///A URI or attribute change for sendURIOperations
+    struct URIOperation {
+      enum class Kind : uint8_t { create_uri, expire_uri, delete_uri, expire_attribute, delete_attribute };
+      Kind kind;
+      world_model::URI uri;
+      ///Attribute name, only used by expire_attribute and delete_attribute
+      std::u16string name;
+      ///Creation or expiration time, unused by the delete operations
+      world_model::grail_time time;
+    };
+
   private:
     ///On-demand requests from clients. These are forwarded from the world model
     struct OnDemandArgs {
       std::u16string request;
-      regex_t exp;
-      bool valid;
+      ///Compiled pattern, null if the request did not compile
+      std::shared_ptr<regex_t> exp;
       bool operator<(const OnDemandArgs& other) const {
         return request < other.request;
       }
     };
 
-    ///Send a handshake and a type declaration message.
-    bool reconnect();
+    ///Send a handshake and a type declaration message on a new socket.
+    bool announce(ClientSocket& sock);
+
+    /**
+     * Thread that owns connecting. It tries each endpoint in turn with a
+     * bounded connect and handshake, and backs off exponentially with
+     * jitter after every endpoint failed.
+     */
+    void manageConnection();
+    std::thread connection_thread;
+    std::atomic<ConnectionState> state;
+    ///True once the destructor has started. Set with send_mutex locked.
+    std::atomic<bool> stopping;
+    ///Signalled with send_mutex whenever state or stopping changes
+    std::condition_variable_any connection_cv;
+
+    /**
+     * Mark the connection as lost so the connection thread replaces it.
+     * Call with send_mutex locked.
+     */
+    void lostConnection();
+
+    /**
+     * Handle a lost connection flagged by the receive thread, then wait
+     * until connected, releasing send_mutex while waiting. Returns false if
+     * the solver is stopping or this is the receive thread.
+     * Call with send_mutex locked.
+     */
+    bool waitConnected();
+
+    ///Stop the receive thread of the previous connection.
+    void stopTracker();
 
     /*
-     * Send a message with automatic retries when disconnected.
-     * First retry is immediate, the next is after 1 second,
-     * and then retries are every 8 seconds.
-     * Will block.
+     * Send a message, waiting for the connection thread whenever the
+     * world model is not connected and resending the whole message after
+     * a failed write. Will block. Throws std::runtime_error if the solver
+     * is being destroyed.
      */
     void sendAndReconnect(const std::vector<unsigned char>& buff);
 
+    ///Send a message given as a gather list, retrying like the buffer version.
+    void sendAndReconnect(const struct iovec* pieces, size_t count);
+
     ///Lock for thread and variables to monitor on-demand request status.
     std::mutex trans_mutex;
     /**
@@ -90,6 +187,76 @@ class SolverWorldModel {
     std::map<uint32_t, std::multiset<OnDemandArgs>> on_demand_on;
     ///Thread that runs the trackOnDemands process
     std::thread on_demand_tracker;
+    ///Optional callback for on_demand changes. Protected by trans_mutex.
+    OnDemandCallback on_demand_callback;
+    ///A type and its requests, waiting to be reported to on_demand_callback
+    typedef std::pair<std::u16string, std::vector<std::u16string>> OnDemandReport;
+    /**
+     * Reports in the order that they were captured. Protected by trans_mutex
+     * so that the order matches the order of the changes.
+     */
+    std::deque<OnDemandReport> notify_queue;
+    ///Thread that delivers every report, started by setOnDemandCallback
+    std::thread notify_thread;
+    std::condition_variable notify_cv;
+    ///True when notify_thread should exit. Protected by trans_mutex.
+    bool notify_stop;
+    ///Queue the requests for the given aliases for on_demand_callback
+    void notifyOnDemand(const std::set<uint32_t>& changed);
+    /**
+     * Deliver queued reports one at a time without holding any lock so that
+     * the callback may send data or wait for a connection.
+     */
+    void notifyThread();
+
+    /**
+     * An immutable copy of the type names and compiled on_demand patterns.
+     * A new snapshot is published whenever either changes so that readers
+     * never need trans_mutex.
+     */
+    struct OnDemandSnapshot {
+      std::unordered_map<std::u16string, uint32_t> aliases;
+      ///Patterns for each on_demand alias. Other aliases are always sent.
+      std::unordered_map<uint32_t, std::vector<std::shared_ptr<regex_t>>> patterns;
+    };
+    /**
+     * Current snapshot. It only changes with trans_mutex locked, so code
+     * holding trans_mutex may use it directly; other readers use a
+     * SnapshotReader.
+     */
+    std::atomic<const OnDemandSnapshot*> on_demand_snapshot;
+    /**
+     * Number of SnapshotReaders that entered while the epoch was even and
+     * odd. A replaced snapshot is freed once the readers of the epoch it
+     * was read in have left.
+     */
+    std::atomic<size_t> snapshot_readers[2];
+    std::atomic<uint32_t> snapshot_epoch;
+    ///Keeps the current snapshot alive without taking any locks
+    class SnapshotReader {
+      public:
+        SnapshotReader(SolverWorldModel& swm);
+        ~SnapshotReader();
+        const OnDemandSnapshot& snapshot() const;
+      private:
+        ///The counter of the epoch this reader entered in
+        std::atomic<size_t>* readers;
+        const OnDemandSnapshot* current;
+        SnapshotReader& operator=(const SnapshotReader&) = delete;
+        SnapshotReader(const SnapshotReader&) = delete;
+    };
+    /**
+     * Publish a new snapshot from types and on_demand_on and free the old
+     * one once no reader uses it. Call with trans_mutex locked.
+     */
+    void publishOnDemand();
+    /**
+     * True unless alias is on_demand and no pattern in the snapshot matches.
+     * Growth of the per-thread URI buffer is counted in allocations if it
+     * is not null.
+     */
+    static bool isRequested(const OnDemandSnapshot& snapshot, uint32_t alias, const world_model::URI& target,
+        std::atomic<uint64_t>* allocations = nullptr);
     ///True when threaded operations should stop
     bool interrupted;
     ///True when threaded trackOnDemands process is running
@@ -102,6 +269,138 @@ class SolverWorldModel {
      * */
     void trackOnDemands();
 
+    ///Hash and time of the last data sent for one type of a URI
+    struct SentValue {
+      uint64_t data_hash;
+      world_model::grail_time time;
+    };
+    ///True if updates repeating the last value sent should be dropped
+    bool suppress_unchanged;
+    ///Unchanged values are resent once they are this many milliseconds old
+    world_model::grail_time refresh_interval;
+    /**
+     * The last values sent while suppress_unchanged is set, keyed by a hash
+     * of the target URI and type alias so that URIs are not stored.
+     * Protected by trans_mutex.
+     */
+    std::unordered_map<uint64_t, SentValue> last_sent;
+    ///last_sent is emptied when it reaches this many entries
+    size_t max_sent_values;
+    ///Key of a target URI and type alias in last_sent
+    static uint64_t sentKey(uint32_t alias, const world_model::URI& target);
+    ///Number of updates that were dropped because they were unchanged
+    std::atomic<uint64_t> suppressed;
+
+    /**
+     * Returns true if the data repeats the last value sent for this
+     * target and type, otherwise remembers it as the last value sent.
+     * Call with trans_mutex locked.
+     */
+    bool isUnchanged(uint32_t alias, const world_model::URI& target,
+        world_model::grail_time time, const std::vector<uint8_t>& data);
+
+    ///Forget the values sent for a URI, or only for one of its types.
+    void forgetSent(const world_model::URI& uri, const std::u16string* type = nullptr);
+    ///Like forgetSent, but call with trans_mutex locked.
+    void eraseSent(const world_model::URI& uri, const std::u16string* type);
+
+    ///An update with its type alias already resolved
+    struct AliasedUpdate {
+      uint32_t alias;
+      world_model::grail_time time;
+      const world_model::URI* target;
+      const std::vector<uint8_t>* data;
+    };
+    ///A coalesced update waiting for the end of its window
+    struct PendingUpdate {
+      uint32_t alias;
+      AttrUpdate update;
+      bool create_uris;
+    };
+    ///Length of the coalescing window in milliseconds, 0 when not coalescing
+    world_model::grail_time coalesce_window;
+    ///Newest update for each target and type in the current window
+    std::vector<PendingUpdate> pending;
+    ///The window being sent, kept to reuse its capacity. Protected by flush_mutex.
+    std::vector<PendingUpdate> flushing;
+    /**
+     * Open addressing table of indices into pending (offset by one so that
+     * zero marks an empty slot). Protected by trans_mutex along with pending.
+     */
+    std::vector<size_t> pending_slots;
+    ///Thread that sends the coalesced updates when each window closes
+    std::thread coalesce_thread;
+    std::condition_variable coalesce_cv;
+    ///Keeps windows in order when they are flushed from different threads
+    std::mutex flush_mutex;
+
+    ///Find the slot of this target and type, or the empty slot where it belongs
+    size_t pendingSlot(uint32_t alias, const world_model::URI& target);
+    /**
+     * Add an update to the current window, moving its target and data if
+     * movable is true. Call with trans_mutex locked.
+     */
+    void coalesce(uint32_t alias, world_model::grail_time time, world_model::URI& target,
+        std::vector<uint8_t>& data, bool create_uris, bool movable);
+    ///Flush the coalescing window every coalesce_window milliseconds
+    void coalesceThread();
+
+    /**
+     * An encoded message as a gather list. Message fields and small payloads
+     * are written into headers while large payloads are referenced in place.
+     */
+    struct GatherFrame {
+      std::vector<unsigned char> headers;
+      std::vector<struct iovec> pieces;
+      ///Total number of bytes in the message
+      size_t size;
+    };
+    /**
+     * Encode a solution message directly from the updates without copying
+     * them into world_model::solver::SolutionData. Large payloads are not
+     * copied at all, so the updates must outlive the frame.
+     */
+    static void encodeSolutionMsg(bool create_uris, const std::vector<AliasedUpdate>& updates, GatherFrame& frame);
+    ///Buffers for one outgoing message, reused through frame_pool
+    struct OutgoingFrame {
+      std::vector<AliasedUpdate> updates;
+      GatherFrame gather;
+    };
+    /**
+     * Frames that are not in use. Frames return here after each send so the
+     * steady state send path does not allocate.
+     */
+    std::vector<std::unique_ptr<OutgoingFrame>> frame_pool;
+    std::mutex pool_mutex;
+    /**
+     * Number of allocations made while sending: pooled frames created or
+     * grown, control messages, coalescing, unchanged-value tracking, the
+     * URI buffer used for on_demand matching, and new journal segments.
+     */
+    std::atomic<uint64_t> send_allocations;
+    /**
+     * Encode a control message into a pooled frame with encode(buffer) and
+     * send it.
+     */
+    template<typename Encoder>
+    void sendControl(Encoder encode);
+    std::unique_ptr<OutgoingFrame> acquireFrame();
+    void releaseFrame(std::unique_ptr<OutgoingFrame> frame);
+
+    ///Journal (if enabled) and send the updates in a frame
+    void sendSolutions(OutgoingFrame& frame, bool create_uris);
+    ///Alias of an update's type, or 0 if it is unknown. Call with trans_mutex locked.
+    uint32_t aliasOf(const AttrUpdate& update);
+    uint32_t aliasOf(const HandleUpdate& update);
+    /**
+     * Filter and send (or coalesce) updates for the sendData overloads.
+     * The range may hold updates or pointers to updates.
+     */
+    template<typename Iterator>
+    void sendUpdates(Iterator begin, Iterator end, bool create_uris, bool movable);
+    //Allow ShardedSolverWorldModel to send partitions without copying them
+    friend class ShardedSolverWorldModel;
+
     std::vector<world_model::solver::AliasType> types;
     std::map<std::u16string, uint32_t> aliases;
 
@@ -109,7 +408,13 @@ class SolverWorldModel {
     std::u16string origin;
 
     ClientSocket s;
+    ///Descriptor of the connected socket, used for gathered writes
+    int sock_fd;
     MessageReceiver ss;
+    ///World models to connect to, in order of preference
+    std::vector<Endpoint> endpoints;
+    ///Index of the endpoint that ip and port refer to
+    size_t endpoint;
     std::string ip;
     uint16_t port;
 
@@ -118,15 +423,85 @@ class SolverWorldModel {
      * This keeps the SolverConnection class thread safe.
      */
     std::mutex send_mutex;
+
+    /**
+     * Holds send_mutex for one sender. A keep alive reply that was queued
+     * while the lock was held is written before the lock is released.
+     */
+    class SendLock {
+      public:
+        SendLock(SolverWorldModel* swm, std::unique_lock<std::mutex>&& lck);
+        SendLock(SendLock&& other);
+        ~SendLock();
+      private:
+        SolverWorldModel* swm;
+        std::unique_lock<std::mutex> lck;
+    };
+
+    ///Lock send_mutex, recording how long that took
+    SendLock lockSend();
+
+    /**
+     * True when the receive thread owes the world model a keep alive.
+     * The receive thread never waits for send_mutex: if another thread is
+     * sending then the reply is written by that thread between messages.
+     */
+    std::atomic<bool> keep_alive_pending;
+
+    /**
+     * Handle queued keep alives and lost connections, then unlock
+     * send_mutex. Repeats if more work was queued after unlocking and
+     * nobody else holds the lock.
+     */
+    void releaseSend(std::unique_lock<std::mutex>& lck);
+
+    ///True when the receive thread found that the connection is gone.
+    std::atomic<bool> connection_lost;
+
+    ///Handle queued keep alives and lost connections without waiting for other senders.
+    void queueControl();
+
+    //Histograms behind sendStatistics
+    LogHistogram lock_wait;
+    LogHistogram encode;
+    LogHistogram socket_write;
+    LogHistogram retry;
+    LogHistogram message_bytes;
+
+    /**
+     * Optional journal of solution messages that have not been sent yet.
+     * The table of type aliases is its context, kept current by addTypes.
+     */
+    std::unique_ptr<SolutionJournal> journal;
+    /**
+     * Rewrite a solution message from the journal of an earlier run so
+     * that its aliases refer to the same type names in this run. Solutions
+     * whose types are not registered are removed. Returns the number of
+     * solutions left in the message.
+     */
+    size_t remapJournaled(std::vector<unsigned char>& message, const SolutionJournal::Context& context);
   public:
 
     /*
      * Connect to the world model at the given ip address and port and
-     * immediately announce the provided types.
+     * immediately announce the provided types. The connection is made in
+     * the background, so this returns before any connection exists and
+     * connected() is false right after construction. Sends wait until the
+     * world model is connected; call waitForConnection to wait up front.
      * OnDemand types are indicated with a true boolean value in their pairs.
      */
     SolverWorldModel(std::string ip, uint16_t port, std::vector<std::pair<std::u16string, bool>>& types, std::u16string origin);
 
+    /*
+     * Connect to the first reachable world model in the list. If the
+     * connection is lost the solver fails over to the next endpoint right
+     * away, announces its types there, and resends the message that was
+     * interrupted. Retry delays only apply after every endpoint failed.
+     * Like the constructor above this returns before connecting.
+     * Throws std::invalid_argument if no endpoints are given.
+     */
+    SolverWorldModel(const std::vector<Endpoint>& endpoints, std::vector<std::pair<std::u16string, bool>>& types, std::u16string origin);
+
     ~SolverWorldModel();
 
     /*
@@ -134,10 +509,34 @@ class SolverWorldModel {
      */
     bool connected();
 
+    /*
+     * Wait up to timeout milliseconds for the background connection thread
+     * to connect and announce the types. Returns true if connected.
+     */
+    bool waitForConnection(world_model::grail_time timeout);
+
+    ///Return the state of the background connection thread.
+    ConnectionState connectionState();
+
 		/*
-		 * Register new solution types.
+		 * Register new solution types. Returns their handles in the same order.
 		 */
-		void addTypes(std::vector<std::pair<std::u16string, bool>>& new_types);
+		std::vector<TypeHandle> addTypes(std::vector<std::pair<std::u16string, bool>>& new_types);
+
+    /*
+     * Return the handle of a registered type, or 0 if the type is unknown.
+     */
+    TypeHandle typeHandle(const std::u16string& type);
+
+    /*
+     * Returns true if sendData would forward a solution of this type for
+     * the given URI, so that solvers can skip computing on_demand values
+     * that nobody has requested. Types that are not on_demand are always
+     * requested while unknown types never are. This does not take any
+     * locks and may be called from any thread.
+     */
+    bool isRequested(const std::u16string& type, const world_model::URI& uri);
+    bool isRequested(TypeHandle type, const world_model::URI& uri);
 
     /*
      * Send new data to the world model.
@@ -148,6 +547,89 @@ class SolverWorldModel {
      */
     void sendData(std::vector<AttrUpdate>& solution, bool create_uris = true);
 
+    /*
+     * Send new data to the world model, taking ownership of the updates.
+     * Coalesced updates are moved rather than copied.
+     */
+    void sendData(std::vector<AttrUpdate>&& solution, bool create_uris = true);
+
+    /*
+     * Send new data whose types are given by handle rather than by name.
+     * Updates with unknown handles are dropped.
+     */
+    void sendData(std::vector<HandleUpdate>& solution, bool create_uris = true);
+    void sendData(std::vector<HandleUpdate>&& solution, bool create_uris = true);
+
+    /*
+     * Drop updates whose data is the same as the last value sent for the
+     * same target URI and type. An unchanged value is still sent when its
+     * time is at least refresh_interval milliseconds after the last one sent.
+     * At most max_entries values are remembered; when the table is full it
+     * is emptied, so some unchanged values are sent one more time.
+     */
+    void suppressUnchanged(bool enable, world_model::grail_time refresh_interval = 60000,
+        size_t max_entries = 1 << 20);
+
+    /*
+     * Return the number of updates that were dropped because they were
+     * unchanged.
+     */
+    uint64_t suppressedCount();
+
+    /*
+     * Coalesce updates for the given number of milliseconds before sending
+     * them. Only the newest update for each target URI and type is kept
+     * during a window and the window is sent as a single solution message,
+     * so traffic is bounded by the number of distinct attributes rather than
+     * by the update rate. A window of 0 (the default) sends immediately.
+     */
+    void coalesceUpdates(world_model::grail_time window);
+
+    /*
+     * Send any updates waiting in the current coalescing window.
+     */
+    void flush();
+
+    /*
+     * Return the number of allocations made on the send path by solutions
+     * and control messages: pooled buffers that were created or had to
+     * grow, coalescing windows that grew or copied an update, values
+     * remembered for unchanged-value suppression, the per-thread buffer used
+     * to match on_demand patterns, and new journal segments. This stops
+     * growing once the buffers have warmed up and the set of targets is
+     * stable. Only allocations inside the regex library are not counted.
+     */
+    uint64_t sendAllocations();
+
+    /*
+     * Call the given function whenever the on_demand requests of a type
+     * start or stop, so that the solver can skip work that nobody has
+     * requested. The function is first called with the current requests of
+     * every on_demand type and afterwards whenever they change. All calls
+     * are made from one thread owned by this object, in the order that the
+     * changes happened, and no lock is held during a call, so the function
+     * may send data. It must not call setOnDemandCallback or destroy this
+     * object.
+     */
+    void setOnDemandCallback(OnDemandCallback callback);
+
+    /*
+     * Return the current send path statistics. This does not lock anything
+     * so it is cheap to call from another thread.
+     */
+    SendStatistics sendStatistics();
+
+    /*
+     * Journal solution messages in the given directory before they are sent
+     * so that they survive a restart of the solver. Messages left in the
+     * journal by a previous run are sent before this returns, with their
+     * types matched by name since aliases can differ between runs.
+     * Journaled solutions of types that are not registered are dropped, so
+     * call this after adding every type and before sending any data.
+     * Returns false if the journal could not be opened.
+     */
+    bool journalSolutions(const std::string& directory);
+
     /*
      * Create a new URI in the world model.
      */
@@ -172,6 +654,109 @@ class SolverWorldModel {
      * Delete an attribute from the world model.
      */
     void deleteURIAttribute(world_model::URI uri, std::u16string name);
+
+    /*
+     * Send many URI and attribute changes at once. All of the messages are
+     * encoded into one buffer and written with a single send.
+     */
+    void sendURIOperations(const std::vector<URIOperation>& operations);
+};
+
+/**
+ * Several connections from one solver to the world model.
+ * Every connection announces the same types with the same origin and each
+ * update is sent over the connection chosen by a hash of its target URI, so
+ * updates for a URI stay in order while different URIs are sent in parallel.
+ */
+class ShardedSolverWorldModel {
+  public:
+    typedef SolverWorldModel::AttrUpdate AttrUpdate;
+    typedef SolverWorldModel::URIOperation URIOperation;
+    typedef SolverWorldModel::TypeHandle TypeHandle;
+    typedef SolverWorldModel::HandleUpdate HandleUpdate;
+
+  private:
+    std::vector<std::unique_ptr<SolverWorldModel>> shards;
+
+    ///Batches at least this large are sent over the shards in parallel
+    static const size_t parallel_threshold = 256;
+
+    ///Index of the connection that handles this URI
+    size_t shardFor(const world_model::URI& uri) const;
+
+    template<typename Update>
+    void sendUpdates(std::vector<Update>& solution, bool create_uris, bool movable);
+  public:
+    /*
+     * Open the given number of connections to the world model and
+     * announce the provided types on each of them.
+     */
+    ShardedSolverWorldModel(std::string ip, uint16_t port,
+        std::vector<std::pair<std::u16string, bool>>& types, std::u16string origin, size_t connections);
+
+    ///Open the connections with failover between the given world models.
+    ShardedSolverWorldModel(const std::vector<SolverWorldModel::Endpoint>& endpoints,
+        std::vector<std::pair<std::u16string, bool>>& types, std::u16string origin, size_t connections);
+
+    /*
+     * Access one of the connections, for instance to configure coalescing or
+     * unchanged-value suppression on it.
+     */
+    SolverWorldModel& shard(size_t index);
+
+    /*
+     * Return the number of connections.
+     */
+    size_t size() const;
+
+    /*
+     * True if every connection is connected.
+     */
+    bool connected();
+
+    /*
+     * Wait up to timeout milliseconds in total for every connection to
+     * connect. Returns true if all of them are connected.
+     */
+    bool waitForConnection(world_model::grail_time timeout);
+
+    /*
+     * Register new solution types on every connection. Every connection
+     * assigns the same handles so they can be used with any of them.
+     */
+    std::vector<TypeHandle> addTypes(std::vector<std::pair<std::u16string, bool>>& new_types);
+
+    /*
+     * Return the handle of a registered type, or 0 if the type is unknown.
+     */
+    TypeHandle typeHandle(const std::u16string& type);
+
+    /*
+     * Returns true if the connection that handles this URI would forward a
+     * solution of this type for it.
+     */
+    bool isRequested(const std::u16string& type, const world_model::URI& uri);
+    bool isRequested(TypeHandle type, const world_model::URI& uri);
+
+    /*
+     * Send new data to the world model, splitting it across the connections
+     * by target URI.
+     */
+    void sendData(std::vector<AttrUpdate>& solution, bool create_uris = true);
+    void sendData(std::vector<AttrUpdate>&& solution, bool create_uris = true);
+    void sendData(std::vector<HandleUpdate>& solution, bool create_uris = true);
+    void sendData(std::vector<HandleUpdate>&& solution, bool create_uris = true);
+
+    /*
+     * URI and attribute changes are sent over the connection that handles
+     * the URI so that they stay in order with its data.
+     */
+    void createURI(world_model::URI uri, world_model::grail_time created);
+    void expireURI(world_model::URI uri, world_model::grail_time expires);
+    void deleteURI(world_model::URI uri);
+    void expireURIAttribute(world_model::URI uri, std::u16string name, world_model::grail_time expires);
+    void deleteURIAttribute(world_model::URI uri, std::u16string name);
+    void sendURIOperations(const std::vector<URIOperation>& operations);
 };
 
 #endif
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/**
+ * @file spsc_queue.hpp
+ * This file defines an unbounded queue with a single producer and a single
+ * consumer. Pushing and popping do not lock; a mutex is only used when the
+ * consumer has to sleep until the producer pushes something.
+ */
+
+#ifndef __SPSC_QUEUE_HPP__
+#define __SPSC_QUEUE_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <utility>
+
+/**
+ * Queue from one producer thread to one consumer thread. The producer can
+ * close the queue when it has nothing more to send, or fail it with an
+ * exception that the consumer receives after the values already queued.
+ * Nodes are recycled by the producer so a steady stream does not allocate.
+ */
+template<typename T>
+class SPSCQueue {
+  private:
+    struct Node {
+      T value;
+      std::atomic<Node*> next;
+      Node() : next(nullptr) {}
+    };
+
+    //Consumer side. The value of head has been consumed already and the next
+    //value is in head->next.
+    std::atomic<Node*> head;
+
+    //Producer side. Nodes from first up to (not including) head_copy have
+    //been consumed and can be reused.
+    Node* tail;
+    Node* first;
+    Node* head_copy;
+
+    ///True once the producer will not push anything else
+    std::atomic<bool> closed_flag;
+    ///Exception for the consumer, set before closed_flag
+    std::exception_ptr failure;
+
+    ///True while the consumer is sleeping (or about to) in pop
+    std::atomic<bool> waiting;
+    std::mutex wait_mutex;
+    std::condition_variable wait_cv;
+
+    Node* allocNode() {
+      if (first != head_copy) {
+        Node* n = first;
+        first = first->next.load(std::memory_order_relaxed);
+        return n;
+      }
+      head_copy = head.load(std::memory_order_acquire);
+      if (first != head_copy) {
+        Node* n = first;
+        first = first->next.load(std::memory_order_relaxed);
+        return n;
+      }
+      return new Node();
+    }
+
+    ///Wake the consumer if it is waiting
+    void wake() {
+      if (waiting.load()) {
+        std::unique_lock<std::mutex> lck(wait_mutex);
+        wait_cv.notify_one();
+      }
+    }
+
+    SPSCQueue& operator=(const SPSCQueue&) = delete;
+    SPSCQueue(const SPSCQueue&) = delete;
+  public:
+    SPSCQueue() : closed_flag(false), waiting(false) {
+      Node* n = new Node();
+      head = n;
+      tail = n;
+      first = n;
+      head_copy = n;
+    }
+
+    ~SPSCQueue() {
+      Node* n = first;
+      while (nullptr != n) {
+        Node* next = n->next.load(std::memory_order_relaxed);
+        delete n;
+        n = next;
+      }
+    }
+
+    /*
+     * Producer functions
+     */
+
+    ///Add a value for the consumer.
+    void push(T&& value) {
+      Node* n = allocNode();
+      n->value = std::move(value);
+      n->next.store(nullptr, std::memory_order_relaxed);
+      //Sequentially consistent so that either this store is seen by a
+      //consumer that is going to sleep or the consumer is seen waiting
+      tail->next.store(n);
+      tail = n;
+      wake();
+    }
+
+    void push(const T& value) {
+      T copy(value);
+      push(std::move(copy));
+    }
+
+    ///Indicate that nothing else will be pushed.
+    void close() {
+      closed_flag.store(true);
+      wake();
+    }
+
+    ///Close the queue with an error that pop rethrows once the queue is empty.
+    void fail(std::exception_ptr error) {
+      failure = error;
+      close();
+    }
+
+    /*
+     * Consumer functions
+     */
+
+    ///True if there is nothing to pop right now.
+    bool empty() const {
+      return nullptr == head.load(std::memory_order_relaxed)->next.load();
+    }
+
+    ///True if the producer closed or failed the queue.
+    bool closed() const {
+      return closed_flag.load();
+    }
+
+    ///True if the queue was closed and every value was popped.
+    bool finished() const {
+      return closed() and empty();
+    }
+
+    ///True if a call to pop will not block.
+    bool ready() const {
+      return not empty() or closed();
+    }
+
+    ///Pop a value if one is available without blocking.
+    bool tryPop(T& value) {
+      Node* h = head.load(std::memory_order_relaxed);
+      Node* n = h->next.load(std::memory_order_acquire);
+      if (nullptr == n) {
+        return false;
+      }
+      value = std::move(n->value);
+      //Publishing the new head hands the old one back to the producer
+      head.store(n, std::memory_order_release);
+      return true;
+    }
+
+    /**
+     * Pop a value, blocking until one is available. Returns false once the
+     * queue is closed and empty, or rethrows the error it failed with.
+     */
+    bool pop(T& value) {
+      while (not tryPop(value)) {
+        if (closed()) {
+          //A value may have been pushed just before closing
+          if (tryPop(value)) {
+            return true;
+          }
+          if (failure) {
+            std::rethrow_exception(failure);
+          }
+          return false;
+        }
+        std::unique_lock<std::mutex> lck(wait_mutex);
+        waiting.store(true);
+        wait_cv.wait(lck, [&]() { return ready(); });
+        waiting.store(false);
+      }
+      return true;
+    }
+};
+
+#endif
+
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*******************************************************************************
+ * This file defines a range request that is fetched one time slice at a time.
+ ******************************************************************************/
+
+#include "chunked_range.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+using world_model::grail_time;
+
+ChunkedRangeResponse::ChunkedRangeResponse(ClientWorldConnection& cwc,
+    const world_model::client::Request& request, grail_time slice, size_t max_in_flight) :
+  cwc(cwc), request(request), slice(slice), max_in_flight(max_in_flight), next_start(request.start) {
+  if (0 == slice) {
+    throw std::invalid_argument("The slice length of a chunked range request must not be 0");
+  }
+  if (0 == max_in_flight) {
+    throw std::invalid_argument("A chunked range request must allow at least one slice in flight");
+  }
+  //Fix the end of the range now so that later slices agree on it
+  if (0 == this->request.stop_period) {
+    this->request.stop_period = world_model::getGRAILTime();
+  }
+  fill();
+}
+
+ChunkedRangeResponse::ChunkedRangeResponse(ChunkedRangeResponse&& other) :
+  cwc(other.cwc), request(std::move(other.request)), slice(other.slice),
+  max_in_flight(other.max_in_flight), next_start(other.next_start), pending(std::move(other.pending)) {
+  //The moved-from response has nothing left to request
+  other.next_start = request.stop_period;
+}
+
+void ChunkedRangeResponse::fill() {
+  while (pending.size() < max_in_flight and next_start < request.stop_period) {
+    world_model::client::Request part = request;
+    part.start = next_start;
+    //Avoid overflow when the slice reaches past the end of the range
+    part.stop_period = request.stop_period - next_start <= slice ?
+      request.stop_period : next_start + slice;
+    pending.push_back(cwc.rangeRequest(part));
+    next_start = part.stop_period;
+  }
+}
+
+world_model::WorldState ChunkedRangeResponse::next() {
+  if (pending.empty()) {
+    return world_model::WorldState();
+  }
+  //Leave the slice pending if it failed so that isError still reports it
+  world_model::WorldState ws = pending.front().get();
+  pending.pop_front();
+  fill();
+  return ws;
+}
+
+bool ChunkedRangeResponse::hasNext() {
+  return not pending.empty() and pending.front().ready();
+}
+
+bool ChunkedRangeResponse::isError() {
+  return not pending.empty() and pending.front().isError();
+}
+
+std::exception ChunkedRangeResponse::getError() {
+  if (pending.empty()) {
+    return std::exception();
+  }
+  return pending.front().getError();
+}
+
+bool ChunkedRangeResponse::isComplete() {
+  return pending.empty() and next_start >= request.stop_period;
+}
+
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*******************************************************************************
+ * This file defines a pool of client connections to one world model.
+ ******************************************************************************/
+
+#include "client_connection_pool.hpp"
+
+#include <stdexcept>
+#include <tuple>
+
+using world_model::URI;
+using std::u16string;
+using std::vector;
+
+ClientConnectionPool::ClientConnectionPool(const std::string& ip, uint16_t port, size_t size) {
+  if (0 == size) {
+    throw std::invalid_argument("A client connection pool needs at least one connection");
+  }
+  for (size_t i = 0; i < size; ++i) {
+    connections.push_back(std::unique_ptr<ClientWorldConnection>(new ClientWorldConnection(ip, port)));
+  }
+}
+
+size_t ClientConnectionPool::size() const {
+  return connections.size();
+}
+
+ClientWorldConnection& ClientConnectionPool::connection(Priority priority) {
+  //The first connection is reserved for interactive requests
+  size_t first = (Priority::bulk == priority and 1 < connections.size()) ? 1 : 0;
+  ClientWorldConnection* best = nullptr;
+  std::tuple<bool, bool, size_t> best_rank;
+  for (size_t i = first; i < connections.size(); ++i) {
+    ClientWorldConnection& cwc = *connections[i];
+    size_t load = cwc.pendingResponses();
+    //Interactive requests only use a connection that may carry bulk
+    //requests while it is idle, so they never wait behind a large result
+    bool shared_and_busy = Priority::interactive == priority and 0 < i and 0 < load;
+    //Prefer connected, then unshared or idle, then the least loaded
+    std::tuple<bool, bool, size_t> rank(not cwc.connected(), shared_and_busy, load);
+    if (not best or rank < best_rank) {
+      best = &cwc;
+      best_rank = rank;
+    }
+  }
+  return *best;
+}
+
+bool ClientConnectionPool::reconnect() {
+  bool all_connected = true;
+  for (auto& cwc : connections) {
+    if (not cwc->connected()) {
+      all_connected = cwc->reconnect() and all_connected;
+    }
+  }
+  return all_connected;
+}
+
+bool ClientConnectionPool::connected() {
+  for (auto& cwc : connections) {
+    if (cwc->connected()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ClientConnectionPool::setSnapshotCache(size_t max_bytes) {
+  for (auto& cwc : connections) {
+    cwc->setSnapshotCache(max_bytes);
+  }
+}
+
+Response ClientConnectionPool::currentSnapshotRequest(const URI& uri,
+    const vector<u16string>& attributes, Priority priority) {
+  return connection(priority).currentSnapshotRequest(uri, attributes);
+}
+
+Response ClientConnectionPool::currentSnapshotRequest(const URI& uri,
+    const vector<u16string>& attributes, world_model::grail_time max_age, Priority priority) {
+  return connection(priority).currentSnapshotRequest(uri, attributes, max_age);
+}
+
+Response ClientConnectionPool::snapshotRequest(const world_model::client::Request& request, Priority priority) {
+  return connection(priority).snapshotRequest(request);
+}
+
+Response ClientConnectionPool::rangeRequest(const world_model::client::Request& request, Priority priority) {
+  return connection(priority).rangeRequest(request);
+}
+
+Response ClientConnectionPool::snapshotRequest(const world_model::client::Request& request,
+    ClientWorldConnection::URIVisitor visitor, Priority priority) {
+  return connection(priority).snapshotRequest(request, visitor);
+}
+
+Response ClientConnectionPool::rangeRequest(const world_model::client::Request& request,
+    ClientWorldConnection::URIVisitor visitor, Priority priority) {
+  return connection(priority).rangeRequest(request, visitor);
+}
+
+StepResponse ClientConnectionPool::streamRequest(const URI& uri,
+    const vector<u16string>& attributes, uint64_t interval, Priority priority) {
+  return connection(priority).streamRequest(uri, attributes, interval);
+}
+
+StepResponse ClientConnectionPool::streamRequest(const URI& uri,
+    const vector<u16string>& attributes, uint64_t interval,
+    ClientWorldConnection::URIVisitor callback, ClientWorldConnection::Executor executor,
+    Priority priority) {
+  return connection(priority).streamRequest(uri, attributes, interval, callback, executor);
+}
+
@@ -50,6 +50,11 @@
 using namespace world_model;
 using namespace std;
 
+namespace {
+  ///Largest step an alias from the world model may grow a dense alias table
+  const size_t max_alias_growth = 4096;
+}
+
 /*******************************************************************************
  * Functions for the Response class
  ******************************************************************************/
@@ -62,16 +67,29 @@ using namespace std;
 
 Response::~Response() {
   //Indicate to the client world model that it can delete any promises
-  //associated with this request
-  cwc.markFinished(request_key);
+  //associated with this request. A moved-from response has no request.
+  if (data.valid()) {
+    cwc.markFinished(request_key);
+  }
 }
 
 world_model::WorldState Response::get() {
+  SharedState state = getShared();
+  //Unless the caller kept a pointer from getShared, only the future and
+  //this function refer to the result. Other Responses on the same ticket
+  //and the cache are ruled out by claimResult.
+  if (2 == state.use_count() and cwc.claimResult(request_key)) {
+    return std::move(const_cast<world_model::WorldState&>(*state));
+  }
+  return *state;
+};
+
+Response::SharedState Response::getShared() {
   if (isError()) {
     throw getError();
   }
   return data.get();
-};
+}
 
 bool Response::ready() {
 	if (not data.valid()) {
@@ -95,37 +113,73 @@ std::exception Response::getError() {
  * Functions for the StepResponse class
  ******************************************************************************/
 world_model::WorldState StepResponse::next() {
-  if (isError()) {
-    throw getError();
-  }
-	//If a next future wasn't available after the last request then this is invalid
-	if (data.valid()) {
-		world_model::WorldState wd = data.get();
-		//Update the future
-		if (cwc.hasNextFuture(request_key)) {
-			data = cwc.getNextFuture(request_key);
-		}
-		return wd;
-	}
-	else {
-		throw std::logic_error("Next value requested for request without a valid request.");
-	}
+  //Errors arrive through the queue after any updates received before them
+  world_model::WorldState ws;
+  updates->pop(ws);
+  return ws;
 };
 
+world_model::WorldState StepResponse::nextBatch() {
+  world_model::WorldState batch;
+  if (not updates->pop(batch)) {
+    return batch;
+  }
+  world_model::WorldState ws;
+  while (updates->tryPop(ws)) {
+    for (auto& uri_attrs : ws) {
+      std::vector<world_model::Attribute>& attrs = batch[uri_attrs.first];
+      for (world_model::Attribute& attr : uri_attrs.second) {
+        auto I = std::find_if(attrs.begin(), attrs.end(),
+            [&](const world_model::Attribute& a) {
+            return a.name == attr.name and a.origin == attr.origin; });
+        if (attrs.end() == I) {
+          attrs.push_back(std::move(attr));
+        }
+        else {
+          *I = std::move(attr);
+        }
+      }
+    }
+  }
+  return batch;
+}
+
+size_t StepResponse::drain(std::vector<world_model::WorldState>& out) {
+  size_t count = 0;
+  world_model::WorldState ws;
+  while (updates->tryPop(ws)) {
+    out.push_back(std::move(ws));
+    ++count;
+  }
+  //Report a failure once everything before it was read
+  if (0 == count and updates->closed() and updates->pop(ws)) {
+    out.push_back(std::move(ws));
+    ++count;
+  }
+  return count;
+}
+
 StepResponse::~StepResponse() {
+  //A moved-from response no longer owns the request
+  if (not updates) {
+    return;
+  }
+  //Stop a stream that is still running so the world model stops sending it
+  if (not updates->closed()) {
+    try {
+      cwc.cancelRequest(request_key);
+    }
+    catch (std::exception& e) {
+      std::cerr<<"Problem cancelling stream request: "<<e.what()<<'\n';
+    }
+  }
   //Indicate to the client world model that it can delete any promises
   //associated with this request
   cwc.markFinished(request_key);
 }
 
 bool StepResponse::hasNext() {
-	if (not data.valid()) {
-		return false;
-	}
-	else {
-		//Check if the data is ready immediately
-		return std::future_status::ready == (std::future_status)data.wait_for(std::chrono::seconds(0));
-	}
+  return updates->ready();
 }
 
 bool StepResponse::isError() {
@@ -137,43 +191,17 @@ std::exception StepResponse::getError() {
 }
 
 bool StepResponse::isComplete() {
-  return cwc.isComplete(request_key);
+  return updates->finished();
+}
+
+void StepResponse::cancel() {
+  cwc.cancelRequest(request_key);
 }
 
 
 /*******************************************************************************
  * Functions for ClientWorldConnection
  ******************************************************************************/
-//See if a request is still being serviced
-bool ClientWorldConnection::isComplete(uint32_t key) {
-  std::unique_lock<std::mutex> lck(promise_mutex);
-  return (step_promises.end() == step_promises.find(key));
-}
-
-bool ClientWorldConnection::hasNextFuture(uint32_t key) {
-  std::unique_lock<std::mutex> lck(promise_mutex);
-  return step_promises.end() != step_promises.find(key);
-}
-
-std::future<world_model::WorldState> ClientWorldConnection::getNextFuture(uint32_t key) {
-  if (not hasNextFuture(key)) {
-    throw std::logic_error("No next value in request");
-  }
-  std::unique_lock<std::mutex> lck(promise_mutex);
-  std::queue<promise<WorldState>*>& pq = step_promises.find(key)->second;
-  //Remove the previous promise and return a future from the next one
-  promise<WorldState>* prev = pq.front();
-  pq.pop();
-  delete prev;
-  future<WorldState> f = pq.front()->get_future();
-  ////Clear out these promises if the request is complete
-  //if (pq.size() == 1) {
-    //delete pq.front();
-    //step_promises.erase(key);
-  //}
-  return std::move(f);
-}
-
 //Check for an error
 bool ClientWorldConnection::hasError(uint32_t key) {
   std::unique_lock<std::mutex> lck(promise_mutex);
@@ -190,17 +218,51 @@ std::exception ClientWorldConnection::getError(uint32_t key) {
   }
 }
 
+void ClientWorldConnection::endInFlight(uint64_t key) {
+  auto I = in_flight.find(key);
+  if (in_flight.end() != I) {
+    in_flight_tickets.erase(I->second.key);
+    in_flight.erase(I);
+  }
+}
+
 void ClientWorldConnection::markFinished(uint32_t key) {
-  auto I = step_promises.find(key);
-  if (I != step_promises.end()) {
-    //Delete all of the promises in this object
-    //Obviously the user should not delete the client world connection when
-    //they have outstanding Response or StepResponse objects
-    while (not I->second.empty()) {
-      delete I->second.front();
-      I->second.pop();
+  //Obviously the user should not delete the client world connection when
+  //they have outstanding Response or StepResponse objects
+  std::unique_lock<std::mutex> lck(promise_mutex);
+  //Keep a shared request alive while other Responses still wait for it
+  auto I = in_flight.find(key);
+  if (in_flight.end() != I) {
+    if (0 < --I->second.holders) {
+      return;
+    }
+    endInFlight(key);
+  }
+  promises.erase(key);
+  streams.erase(key);
+  partial_results.erase(key);
+  visitors.erase(key);
+  exclusive_results.erase(key);
+}
+
+bool ClientWorldConnection::claimResult(uint32_t key) {
+  std::unique_lock<std::mutex> lck(promise_mutex);
+  return 0 < exclusive_results.erase(key);
+}
+
+void ClientWorldConnection::cancelRequest(uint32_t key) {
+  {
+    std::unique_lock<std::mutex> lck(promise_mutex);
+    visitors.erase(key);
+    auto S = streams.find(key);
+    if (streams.end() != S) {
+      S->second->close();
+      streams.erase(S);
     }
-    step_promises.erase(key);
+  }
+  std::unique_lock<std::mutex> lck(out_mutex);
+  if (s) {
+    s.send(client::makeCancelRequest(key));
   }
 }
 
@@ -260,6 +322,29 @@ bool ClientWorldConnection::reconnect() {
   return true;
 }
 
+void ClientWorldConnection::setAlias(AliasTable& table, uint32_t alias, const std::u16string& name) {
+  if (alias < table.dense.size()) {
+    table.dense[alias] = name;
+  }
+  //Only grow the dense table by a bounded amount for an alias off the wire
+  else if (alias < table.dense.size() + max_alias_growth) {
+    table.dense.resize(alias + 1);
+    table.dense[alias] = name;
+  }
+  else {
+    table.sparse[alias] = name;
+  }
+}
+
+const std::u16string& ClientWorldConnection::aliasName(const AliasTable& table, uint32_t alias) {
+  static const std::u16string unknown;
+  if (alias < table.dense.size()) {
+    return table.dense[alias];
+  }
+  auto I = table.sparse.find(alias);
+  return table.sparse.end() == I ? unknown : I->second;
+}
+
 void ClientWorldConnection::receiveThread() {
   using namespace world_model::client;
   std::cerr<<"Starting client->wm receive thread.\n";
@@ -282,29 +367,46 @@ void ClientWorldConnection::receiveThread() {
         if ( MessageID::attribute_alias == message_type ) {
           std::vector<AliasType> aliases = decodeAttrAliasMsg(raw_message);
           for (auto alias = aliases.begin(); alias != aliases.end(); ++alias) {
-            known_attributes[alias->alias] = alias->type;
+            setAlias(known_attributes, alias->alias, alias->type);
           }
         }
         else if ( MessageID::origin_alias == message_type ) {
           std::vector<AliasType> aliases = decodeOriginAliasMsg(raw_message);
           for (auto alias = aliases.begin(); alias != aliases.end(); ++alias) {
-            known_origins[alias->alias] = alias->type;
+            setAlias(known_origins, alias->alias, alias->type);
           }
         }
         else if ( MessageID::request_complete == message_type ) {
           uint32_t ticket = decodeRequestComplete(raw_message);
           std::unique_lock<std::mutex> lck(promise_mutex);
-          if (step_promises.find(ticket) != step_promises.end()) {
-            if (single_response.count(ticket) != 0) {
-              auto I = step_promises.find(ticket);
-              I->second.front()->set_value(partial_results[ticket]);
-              partial_results.erase(ticket);
+          auto P = promises.find(ticket);
+          if (promises.end() != P) {
+            //The state is not created const so that an unshared result can be
+            //moved out by Response::get
+            Response::SharedState state = std::make_shared<WorldState>(std::move(partial_results[ticket]));
+            P->second->set_value(state);
+            partial_results.erase(ticket);
+            promises.erase(P);
+            //Remember current snapshots if the cache is on
+            auto I = in_flight.find(ticket);
+            bool cached = false;
+            if (0 < cache_limit and in_flight.end() != I and
+                not std::get<0>(I->second.key) and
+                0 == std::get<3>(I->second.key) and 0 == std::get<4>(I->second.key)) {
+              cacheSnapshot(CacheKey(std::get<1>(I->second.key), std::get<2>(I->second.key)),
+                  state, I->second.issued);
+              cached = true;
             }
-            else {
-              //Set the last value to an empty state
-              step_promises.find(ticket)->second.back()->set_value(WorldState());
+            if (not cached and (in_flight.end() == I or 1 >= I->second.holders)) {
+              exclusive_results.insert(ticket);
             }
           }
+          endInFlight(ticket);
+          visitors.erase(ticket);
+          auto S = streams.find(ticket);
+          if (streams.end() != S) {
+            S->second->close();
+          }
         }
         else if ( MessageID::data_response == message_type ) {
           //Convert the aliased world data to unaliased data for the user
@@ -312,27 +414,51 @@ void ClientWorldConnection::receiveThread() {
           uint32_t ticket;
           std::tie(awd, ticket) = decodeDataMessage(raw_message);
           WorldData wd;
-          wd.object_uri = awd.object_uri;
+          wd.object_uri = std::move(awd.object_uri);
+          wd.attributes.reserve(awd.attributes.size());
           std::for_each(awd.attributes.begin(), awd.attributes.end(),
               [&](AliasedAttribute& attr) {
-              wd.attributes.push_back(Attribute{known_attributes[attr.name_alias],
+              wd.attributes.push_back(Attribute{aliasName(known_attributes, attr.name_alias),
                 attr.creation_date,
                 attr.expiration_date,
-                known_origins[attr.origin_alias],
-                attr.data}); });
+                aliasName(known_origins, attr.origin_alias),
+                std::move(attr.data)}); });
           //Now give this world data to the partial result if this is for a
           //Response, or give it directly to a StepResponse
-          std::unique_lock<std::mutex> lck(promise_mutex);
-          if (single_response.count(ticket) != 0) {
-            partial_results[ticket][wd.object_uri] = wd.attributes;
+          std::shared_ptr<StepResponse::UpdateQueue> stream;
+          std::shared_ptr<URIVisitor> visitor;
+          {
+            std::unique_lock<std::mutex> lck(promise_mutex);
+            auto V = visitors.find(ticket);
+            if (visitors.end() != V) {
+              visitor = V->second;
+            }
+            else if (promises.end() != promises.find(ticket)) {
+              partial_results[ticket][wd.object_uri] = std::move(wd.attributes);
+            }
+            else {
+              auto S = streams.find(ticket);
+              if (streams.end() != S) {
+                stream = S->second;
+              }
+            }
+          }
+          if (visitor) {
+            //Visit outside of the lock so the visitor may make new requests
+            try {
+              (*visitor)(wd.object_uri, wd.attributes);
+            }
+            catch (std::exception& e) {
+              //Fail the request first since cancelling forgets its stream,
+              //then tell the world model to stop sending data for it
+              setError(ticket, std::string("visitor failed: ") + e.what());
+              cancelRequest(ticket);
+            }
           }
-          else if (step_promises.find(ticket) != step_promises.end()) {
-            //Set the value of the last entry and make a new promise for the next entry
+          else if (stream) {
             WorldState ws;
-            ws[wd.object_uri] = wd.attributes;
-            auto I = step_promises.find(ticket);
-            I->second.back()->set_value(ws);
-            I->second.push(new promise<WorldState>());
+            ws[wd.object_uri] = std::move(wd.attributes);
+            stream->push(std::move(ws));
           }
         }
         else if ( MessageID::keep_alive == message_type) {
@@ -348,13 +474,21 @@ void ClientWorldConnection::receiveThread() {
   //Catch a network error and mark all of the promises invalid
   catch (std::runtime_error& err) {
     std::unique_lock<std::mutex> lck(promise_mutex);
-    for (auto& ticket_promise : step_promises) {
-      //TODO FIXME Can't find make_exception_ptr anywhere so using throwing and catching to get a pointer
-      try {
-        throw std::runtime_error("Connection Closed");
-      } catch (std::exception e) {
-        ticket_promise.second.back()->set_exception(std::current_exception());
-      }
+    //TODO FIXME Can't find make_exception_ptr anywhere so using throwing and catching to get a pointer
+    std::exception_ptr closed;
+    try {
+      throw std::runtime_error("Connection Closed");
+    } catch (std::exception& e) {
+      closed = std::current_exception();
+    }
+    for (auto& ticket_promise : promises) {
+      ticket_promise.second->set_exception(closed);
+    }
+    promises.clear();
+    in_flight.clear();
+    in_flight_tickets.clear();
+    for (auto& ticket_stream : streams) {
+      ticket_stream.second->fail(closed);
     }
   }
 }
@@ -365,6 +499,10 @@ ClientWorldConnection::ClientWorldConnection(std::string ip, uint16_t port) : s(
   this->port = port;
 
   cur_key = 0;
+  cache_limit = 0;
+  cache_bytes = 0;
+  cache_hits = 0;
+  cache_misses = 0;
 
   interrupted = false;
   reconnect();
@@ -374,18 +512,19 @@ ClientWorldConnection::~ClientWorldConnection() {
   interrupted = true;
   //TODO FIXME Having something that could possible throw an exception in a destructor is bad.
   rx_thread.join();
-  //Delete all of the promises
-  for (auto I = step_promises.begin(); I != step_promises.end(); ++I) {
-    //TODO FIXME Can't find make_exception_ptr anywhere so I'm doing this.
-    try {
-      throw std::logic_error("World Model Connection object is being destroyed");
-    } catch (std::exception e) {
-      I->second.front()->set_exception(std::current_exception());
-    }
-    while (not I->second.empty()) {
-      delete I->second.front();
-      I->second.pop();
-    }
+  //Fail any requests that are still outstanding
+  //TODO FIXME Can't find make_exception_ptr anywhere so I'm doing this.
+  std::exception_ptr destroyed;
+  try {
+    throw std::logic_error("World Model Connection object is being destroyed");
+  } catch (std::exception& e) {
+    destroyed = std::current_exception();
+  }
+  for (auto I = promises.begin(); I != promises.end(); ++I) {
+    I->second->set_exception(destroyed);
+  }
+  for (auto I = streams.begin(); I != streams.end(); ++I) {
+    I->second->fail(destroyed);
   }
 }
 
@@ -393,34 +532,40 @@ ClientWorldConnection::~ClientWorldConnection() {
   //return p.first == key;
 //}
 
-future<WorldState> ClientWorldConnection::makeStepPromise(uint32_t key) {
+std::shared_ptr<StepResponse::UpdateQueue> ClientWorldConnection::makeStream(uint32_t key) {
   std::unique_lock<std::mutex> lck(promise_mutex);
-  step_promises[key] = std::queue<promise<WorldState>*>();
-  step_promises[key].push(new promise<WorldState>());
-  if (errors.find(key) != errors.end()) {
-    errors.erase(key);
-  }
-  return step_promises[key].front()->get_future();
+  std::shared_ptr<StepResponse::UpdateQueue> stream = std::make_shared<StepResponse::UpdateQueue>();
+  streams[key] = stream;
+  errors.erase(key);
+  return stream;
 }
 
-future<WorldState> ClientWorldConnection::makePromise(uint32_t key) {
-  {
-    std::unique_lock<std::mutex> lck(promise_mutex);
-    single_response.insert(key);
-  }
-  return makeStepPromise(key);
+shared_future<Response::SharedState> ClientWorldConnection::makePromise(uint32_t key) {
+  std::unique_lock<std::mutex> lck(promise_mutex);
+  promise<Response::SharedState>* p = new promise<Response::SharedState>();
+  promises[key] = std::unique_ptr<promise<Response::SharedState>>(p);
+  errors.erase(key);
+  return p->get_future().share();
 }
 
 void ClientWorldConnection::setError(uint32_t key, const std::string& error) {
   std::unique_lock<std::mutex> lck(promise_mutex);
-  if (step_promises.end() != step_promises.find(key)) {
-    //TODO FIXME Can't find make_exception_ptr anywhere so I'm doing this.
-    try {
-      throw std::logic_error(error);
-    } catch (std::exception e) {
-      step_promises[key].back()->set_exception(std::current_exception());
-    }
-    //step_promises[key].back()->set_exception(std::logic_error(error));
+  //TODO FIXME Can't find make_exception_ptr anywhere so I'm doing this.
+  std::exception_ptr failure;
+  try {
+    throw std::logic_error(error);
+  } catch (std::exception& e) {
+    failure = std::current_exception();
+  }
+  auto P = promises.find(key);
+  if (promises.end() != P) {
+    P->second->set_exception(failure);
+    promises.erase(P);
+  }
+  endInFlight(key);
+  auto S = streams.find(key);
+  if (streams.end() != S) {
+    S->second->fail(failure);
   }
   errors[key] = std::logic_error(error);
 }
@@ -436,11 +581,143 @@ Response ClientWorldConnection::currentSnapshotRequest(const URI& uri, const vec
   return snapshotRequest(world_model::client::Request{uri, attributes, 0, 0});
 }
 
+Response ClientWorldConnection::currentSnapshotRequest(const URI& uri, const vector<u16string>& attributes, grail_time max_age) {
+  {
+    std::unique_lock<std::mutex> lck(promise_mutex);
+    if (0 < cache_limit) {
+      auto I = snapshot_cache.find(CacheKey(uri, attributes));
+      if (snapshot_cache.end() != I and world_model::getGRAILTime() - I->second.fetched <= max_age) {
+        ++cache_hits;
+        cache_order.splice(cache_order.begin(), cache_order, I->second.recent);
+        //The ticket has no promise so the response never waits or errors
+        promise<Response::SharedState> cached;
+        cached.set_value(I->second.state);
+        return Response(cached.get_future().share(), *this, cur_key++);
+      }
+      ++cache_misses;
+    }
+  }
+  return currentSnapshotRequest(uri, attributes);
+}
+
+namespace {
+  ///Rough number of bytes used by a world state
+  size_t stateBytes(const WorldState& ws) {
+    size_t bytes = 0;
+    for (auto& uri_attrs : ws) {
+      bytes += sizeof(uri_attrs) + uri_attrs.first.size() * sizeof(char16_t);
+      for (const Attribute& attr : uri_attrs.second) {
+        bytes += sizeof(Attribute) + attr.data.size() +
+          (attr.name.size() + attr.origin.size()) * sizeof(char16_t);
+      }
+    }
+    return bytes;
+  }
+}
+
+void ClientWorldConnection::cacheSnapshot(const CacheKey& key, Response::SharedState state, grail_time fetched) {
+  auto I = snapshot_cache.find(key);
+  if (snapshot_cache.end() != I) {
+    //Never replace a result with an older one
+    if (fetched < I->second.fetched) {
+      return;
+    }
+    cache_bytes -= I->second.bytes;
+    cache_order.erase(I->second.recent);
+    snapshot_cache.erase(I);
+  }
+  size_t bytes = stateBytes(*state);
+  if (cache_limit < bytes) {
+    return;
+  }
+  cache_order.push_front(key);
+  snapshot_cache[key] = CachedSnapshot{state, fetched, bytes, cache_order.begin()};
+  cache_bytes += bytes;
+  //Evict the least recently used results until the cache fits
+  while (cache_limit < cache_bytes) {
+    auto J = snapshot_cache.find(cache_order.back());
+    cache_bytes -= J->second.bytes;
+    snapshot_cache.erase(J);
+    cache_order.pop_back();
+  }
+}
+
+void ClientWorldConnection::setSnapshotCache(size_t max_bytes) {
+  std::unique_lock<std::mutex> lck(promise_mutex);
+  cache_limit = max_bytes;
+  if (0 == cache_limit) {
+    snapshot_cache.clear();
+    cache_order.clear();
+    cache_bytes = 0;
+  }
+  //Shrink the cache to the new limit
+  while (cache_limit < cache_bytes) {
+    auto J = snapshot_cache.find(cache_order.back());
+    cache_bytes -= J->second.bytes;
+    snapshot_cache.erase(J);
+    cache_order.pop_back();
+  }
+}
+
+ClientWorldConnection::CacheStatistics ClientWorldConnection::snapshotCacheStatistics() {
+  std::unique_lock<std::mutex> lck(promise_mutex);
+  return CacheStatistics{cache_hits, cache_misses, cache_bytes, snapshot_cache.size()};
+}
+
 Response ClientWorldConnection::snapshotRequest(const client::Request& request) {
+  return coalescedRequest(false, request);
+}
+
+/**
+ * Returns information about the state of any URIs matching the
+ * URI GLOB expression and any attributes matching any of the
+ * GLOB expression in the attributes vector.
+ * Request all changes to the world model occuring between the
+ * given start time and end time.
+ */
+Response ClientWorldConnection::rangeRequest(const client::Request& request) {
+  return coalescedRequest(true, request);
+}
+
+Response ClientWorldConnection::coalescedRequest(bool range, const client::Request& request) {
+  RequestKey key(range, request.object_uri, request.attributes, request.start, request.stop_period);
+  uint64_t ticket;
+  std::shared_future<Response::SharedState> result;
+  {
+    std::unique_lock<std::mutex> lck(promise_mutex);
+    //Attach to an identical request that has not completed yet
+    auto I = in_flight_tickets.find(key);
+    if (in_flight_tickets.end() != I) {
+      InFlight& shared = in_flight[I->second];
+      ++shared.holders;
+      return Response(shared.result, *this, I->second);
+    }
+    ticket = cur_key++;
+    promise<Response::SharedState>* p = new promise<Response::SharedState>();
+    promises[ticket] = std::unique_ptr<promise<Response::SharedState>>(p);
+    errors.erase(ticket);
+    result = p->get_future().share();
+    in_flight_tickets[key] = ticket;
+    in_flight[ticket] = InFlight{key, result, 1, world_model::getGRAILTime()};
+  }
+  Response r(result, *this, ticket);
+  std::unique_lock<std::mutex> lck(out_mutex);
+  if (not s and not reconnect()) {
+    setError(ticket, "not connected");
+  }
+  else {
+    //Send the request and prepare a promise
+    s.send(range ? client::makeRangeRequest(request, ticket) : client::makeSnapshotRequest(request, ticket));
+  }
+  return r;
+}
+
+Response ClientWorldConnection::snapshotRequest(const client::Request& request, URIVisitor visitor) {
   uint64_t ticket;
   {
     std::unique_lock<std::mutex> lck(promise_mutex);
     ticket = cur_key++;
+    visitors[ticket] = std::make_shared<URIVisitor>(visitor);
   }
   Response r(makePromise(ticket), *this, ticket);
   std::unique_lock<std::mutex> lck(out_mutex);
@@ -448,24 +725,17 @@ Response ClientWorldConnection::snapshotRequest(const client::Request& request)
     setError(ticket, "not connected");
   }
   else {
-    //Send the snapshot request and prepare a promise
     s.send(client::makeSnapshotRequest(request, ticket));
   }
   return r;
 }
 
-/**
- * Returns information about the state of any URIs matching the
- * URI GLOB expression and any attributes matching any of the
- * GLOB expression in the attributes vector.
- * Request all changes to the world model occuring between the
- * given start time and end time.
- */
-Response ClientWorldConnection::rangeRequest(const client::Request& request) {
+Response ClientWorldConnection::rangeRequest(const client::Request& request, URIVisitor visitor) {
   uint64_t ticket;
   {
     std::unique_lock<std::mutex> lck(promise_mutex);
     ticket = cur_key++;
+    visitors[ticket] = std::make_shared<URIVisitor>(visitor);
   }
   Response r(makePromise(ticket), *this, ticket);
   std::unique_lock<std::mutex> lck(out_mutex);
@@ -473,7 +743,6 @@ Response ClientWorldConnection::rangeRequest(const client::Request& request) {
     setError(ticket, "not connected");
   }
   else {
-    //Send the snapshot request and prepare a promise
     s.send(client::makeRangeRequest(request, ticket));
   }
   return r;
@@ -495,7 +764,7 @@ StepResponse ClientWorldConnection::streamRequest(const URI& uri, const vector<u
     std::unique_lock<std::mutex> lck(promise_mutex);
     ticket = cur_key++;
   }
-  StepResponse r(makeStepPromise(ticket), *this, ticket);
+  StepResponse r(makeStream(ticket), *this, ticket);
   std::unique_lock<std::mutex> lck(out_mutex);
   if (not s and not reconnect()) {
     setError(ticket, "not connected");
@@ -511,6 +780,36 @@ StepResponse ClientWorldConnection::streamRequest(const URI& uri, const vector<u
   return r;
 }
 
+StepResponse ClientWorldConnection::streamRequest(const URI& uri, const vector<u16string>& attributes, uint64_t interval,
+    URIVisitor callback, Executor executor) {
+  //Hand a copy of each update to the executor if there is one
+  URIVisitor deliver = callback;
+  if (executor) {
+    deliver = [callback, executor](const URI& target, const std::vector<Attribute>& attrs) {
+      executor([callback, target, attrs]() { callback(target, attrs); });
+    };
+  }
+  uint64_t ticket;
+  {
+    std::unique_lock<std::mutex> lck(promise_mutex);
+    ticket = cur_key++;
+    visitors[ticket] = std::make_shared<URIVisitor>(deliver);
+  }
+  StepResponse r(makeStream(ticket), *this, ticket);
+  std::unique_lock<std::mutex> lck(out_mutex);
+  if (not s and not reconnect()) {
+    setError(ticket, "not connected");
+  }
+  else {
+    client::Request request;
+    request.object_uri = uri;
+    request.attributes = attributes;
+    request.stop_period = interval;
+    s.send(client::makeStreamRequest(request, ticket));
+  }
+  return r;
+}
+
 /**
  * Returns true if this instance is connected to the world model,
  * false otherwise.
@@ -524,4 +823,7 @@ bool ClientWorldConnection::connected() {
   }
 }
 
-
+size_t ClientWorldConnection::pendingResponses() {
+  std::unique_lock<std::mutex> lck(promise_mutex);
+  return promises.size();
+}
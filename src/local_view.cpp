@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*******************************************************************************
+ * This file defines a local copy of world model state that follows a stream.
+ ******************************************************************************/
+
+#include "local_view.hpp"
+
+#include <algorithm>
+#include <functional>
+
+using world_model::Attribute;
+using world_model::URI;
+
+LocalView::Stripe& LocalView::Index::stripeFor(const URI& uri) {
+  return stripes[std::hash<URI>()(uri) % num_stripes];
+}
+
+void LocalView::Index::apply(const URI& uri, const std::vector<Attribute>& attributes) {
+  Stripe& stripe = stripeFor(uri);
+  std::unique_lock<std::mutex> lck(stripe.mutex);
+  //Only add the URI once it has an attribute that is not expired
+  auto V = stripe.values.find(uri);
+  bool seeding = this->seeding;
+  for (const Attribute& attr : attributes) {
+    auto same = [&](const Attribute& a) { return a.name == attr.name and a.origin == attr.origin; };
+    if (seeding) {
+      //A value from the seed may be older than an expiration from the stream
+      auto E = stripe.expired.find(uri);
+      if (stripe.expired.end() != E) {
+        auto T = std::find_if(E->second.begin(), E->second.end(), same);
+        if (E->second.end() != T and attr.creation_date <= T->creation_date) {
+          continue;
+        }
+      }
+      if (0 != attr.expiration_date) {
+        std::vector<Attribute>& tombstones = stripe.expired[uri];
+        auto T = std::find_if(tombstones.begin(), tombstones.end(), same);
+        if (tombstones.end() == T) {
+          tombstones.push_back(Attribute{attr.name, attr.creation_date, attr.expiration_date, attr.origin, {}});
+        }
+        else {
+          T->creation_date = attr.creation_date;
+          T->expiration_date = attr.expiration_date;
+        }
+      }
+    }
+    std::vector<Attribute>* current = stripe.values.end() == V ? nullptr : &V->second.attributes;
+    auto I = current ? std::find_if(current->begin(), current->end(), same) :
+      std::vector<Attribute>::iterator();
+    bool found = current and current->end() != I;
+    //The snapshot and the stream can overlap so never go back in time
+    if (found and attr.creation_date < I->creation_date) {
+      continue;
+    }
+    //Expired attributes are no longer part of the current state
+    if (0 != attr.expiration_date) {
+      if (found) {
+        current->erase(I);
+      }
+      continue;
+    }
+    if (found) {
+      *I = attr;
+    }
+    else {
+      if (stripe.values.end() == V) {
+        V = stripe.values.insert(std::make_pair(uri, Value{std::vector<Attribute>(), 0, 0})).first;
+      }
+      V->second.attributes.push_back(attr);
+    }
+    V->second.updated = std::max(V->second.updated, attr.creation_date);
+  }
+  if (stripe.values.end() == V) {
+    return;
+  }
+  uint64_t applied = ++version;
+  //A URI without attributes would not be in a fresh snapshot either
+  if (V->second.attributes.empty()) {
+    stripe.values.erase(V);
+  }
+  else {
+    V->second.version = applied;
+  }
+}
+
+void LocalView::Index::endSeed() {
+  //Applies that saw seeding set finish before their stripe is cleared
+  seeding = false;
+  for (Stripe& stripe : stripes) {
+    std::unique_lock<std::mutex> lck(stripe.mutex);
+    stripe.expired.clear();
+  }
+}
+
+LocalView::LocalView(ClientWorldConnection& cwc, const URI& uri,
+    const std::vector<std::u16string>& attributes, uint64_t interval) :
+  index(std::make_shared<Index>()),
+  updates(cwc.streamRequest(uri, attributes, interval,
+        std::bind(&Index::apply, index, std::placeholders::_1, std::placeholders::_2))),
+  seed(cwc.snapshotRequest(world_model::client::Request{uri, attributes, 0, 0},
+        std::bind(&Index::apply, index, std::placeholders::_1, std::placeholders::_2))) {
+}
+
+void LocalView::checkSeed() {
+  if (index->seeding and seed.ready()) {
+    index->endSeed();
+  }
+}
+
+bool LocalView::ready() {
+  checkSeed();
+  return seed.ready();
+}
+
+bool LocalView::isError() {
+  return seed.isError() or updates.isError();
+}
+
+bool LocalView::lookup(const URI& uri, Value& value) {
+  checkSeed();
+  Stripe& stripe = index->stripeFor(uri);
+  std::unique_lock<std::mutex> lck(stripe.mutex);
+  auto I = stripe.values.find(uri);
+  if (stripe.values.end() == I) {
+    return false;
+  }
+  value = I->second;
+  return true;
+}
+
+world_model::WorldState LocalView::snapshot() {
+  checkSeed();
+  world_model::WorldState ws;
+  for (Stripe& stripe : index->stripes) {
+    std::unique_lock<std::mutex> lck(stripe.mutex);
+    for (auto& uri_value : stripe.values) {
+      ws[uri_value.first] = uri_value.second.attributes;
+    }
+  }
+  return ws;
+}
+
+uint64_t LocalView::version() {
+  return index->version;
+}
+
+size_t LocalView::size() {
+  size_t total = 0;
+  for (Stripe& stripe : index->stripes) {
+    std::unique_lock<std::mutex> lck(stripe.mutex);
+    total += stripe.values.size();
+  }
+  return total;
+}
+
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*******************************************************************************
+ * This file defines a lock free histogram with logarithmically sized buckets.
+ ******************************************************************************/
+
+#include "log_histogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+LogHistogram::LogHistogram() {
+  for (size_t b = 0; b < num_buckets; ++b) {
+    counts[b].store(0);
+  }
+  count.store(0);
+  sum.store(0);
+  max.store(0);
+}
+
+size_t LogHistogram::bucketFor(uint64_t value) {
+  //Small values each get their own bucket
+  if (value < sub_buckets) {
+    return value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - sub_bits;
+  return (shift + 1) * sub_buckets + ((value >> shift) & (sub_buckets - 1));
+}
+
+uint64_t LogHistogram::bucketLimit(size_t bucket) {
+  if (bucket < sub_buckets) {
+    return bucket;
+  }
+  int shift = bucket / sub_buckets - 1;
+  uint64_t lower = (uint64_t)(sub_buckets + bucket % sub_buckets) << shift;
+  return lower + (((uint64_t)1 << shift) - 1);
+}
+
+void LogHistogram::record(uint64_t value) {
+  counts[bucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(value, std::memory_order_relaxed);
+  uint64_t prev = max.load(std::memory_order_relaxed);
+  while (prev < value and
+      not max.compare_exchange_weak(prev, value, std::memory_order_relaxed)) {
+  }
+}
+
+LogHistogram::Snapshot LogHistogram::snapshot() const {
+  Snapshot snap;
+  snap.counts.resize(num_buckets);
+  snap.count = 0;
+  for (size_t b = 0; b < num_buckets; ++b) {
+    snap.counts[b] = counts[b].load(std::memory_order_relaxed);
+    //Count the buckets so that the total matches them exactly
+    snap.count += snap.counts[b];
+  }
+  snap.sum = sum.load(std::memory_order_relaxed);
+  snap.max = max.load(std::memory_order_relaxed);
+  return snap;
+}
+
+double LogHistogram::Snapshot::mean() const {
+  return 0 == count ? 0.0 : (double)sum / count;
+}
+
+uint64_t LogHistogram::Snapshot::percentile(double fraction) const {
+  if (0 == count) {
+    return 0;
+  }
+  uint64_t target = (uint64_t)std::ceil(std::min(std::max(fraction, 0.0), 1.0) * count);
+  uint64_t seen = 0;
+  for (size_t b = 0; b < counts.size(); ++b) {
+    seen += counts[b];
+    if (seen >= target and 0 < seen) {
+      return std::min(bucketLimit(b), max);
+    }
+  }
+  return max;
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2012 Bernhard Firner and Rutgers University
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+ * or visit http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/*******************************************************************************
+ * This file defines an append-only journal of solver messages that are
+ * stored in memory mapped segment files until they are sent.
+ ******************************************************************************/
+
+#include "solution_journal.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace {
+  const char journal_magic[8] = {'O', 'W', 'L', 'S', 'J', 'N', 'L', '\0'};
+  const uint32_t journal_version = 2;
+
+  ///Header at the beginning of every segment file
+  struct SegmentHeader {
+    char magic[8];
+    uint32_t version;
+    /**
+     * Incremented whenever the segment is reused so that records left over
+     * from the previous use are not mistaken for new ones.
+     */
+    uint32_t generation;
+    ///Offset of the oldest record that has not been released
+    uint64_t read_offset;
+    uint64_t reserved;
+  };
+
+  /**
+   * Context records hold the data set with setContext and apply to the
+   * records that follow them in the same segment.
+   */
+  enum RecordState : uint32_t { record_unsent = 0, record_sent = 1, record_context = 2 };
+
+  ///Header in front of every journaled message
+  struct RecordHeader {
+    uint32_t length;
+    uint32_t generation;
+    ///CRC-32 of the length, generation, and message bytes
+    uint32_t checksum;
+    uint32_t state;
+  };
+
+  const char* segment_prefix = "solutions.";
+  const char* segment_suffix = ".journal";
+
+  size_t recordSize(size_t length) {
+    //Keep record headers 8 byte aligned
+    return (sizeof(RecordHeader) + length + 7) & ~size_t(7);
+  }
+
+  std::vector<uint32_t> makeCRCTable() {
+    std::vector<uint32_t> table(256);
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      }
+      table[i] = c;
+    }
+    return table;
+  }
+
+  uint32_t crc32(const unsigned char* data, size_t length, uint32_t crc = 0) {
+    static const std::vector<uint32_t> table = makeCRCTable();
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+      crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+
+  uint32_t recordChecksum(const RecordHeader& rh, const unsigned char* data) {
+    uint32_t crc = crc32((const unsigned char*)&rh.length, sizeof(rh.length));
+    crc = crc32((const unsigned char*)&rh.generation, sizeof(rh.generation), crc);
+    return crc32(data, rh.length, crc);
+  }
+
+  SolutionJournal::RecordID makeID(uint32_t index, size_t offset) {
+    return ((uint64_t)index << 32) | (uint32_t)offset;
+  }
+}
+
+std::string SolutionJournal::segmentPath(uint32_t index) const {
+  return directory + "/" + segment_prefix + std::to_string(index) + segment_suffix;
+}
+
+bool SolutionJournal::mapSegment(uint32_t index, size_t min_size, Segment& seg) {
+  std::string path = segmentPath(index);
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (0 > fd) {
+    std::cerr<<"Error opening solution journal segment "<<path<<'\n';
+    return false;
+  }
+  struct stat st;
+  if (0 != fstat(fd, &st)) {
+    close(fd);
+    return false;
+  }
+  bool created = (size_t)st.st_size < sizeof(SegmentHeader);
+  size_t size = std::max((size_t)st.st_size, min_size);
+  //Reserve the blocks now. Writing to a hole in a shared mapping raises
+  //SIGBUS when the disk is full instead of returning an error.
+  int err = posix_fallocate(fd, 0, size);
+  if (0 != err) {
+    std::cerr<<"Error reserving space for solution journal segment "<<path<<": "<<std::strerror(err)<<'\n';
+    close(fd);
+    if (created) {
+      unlink(path.c_str());
+    }
+    return false;
+  }
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == base) {
+    std::cerr<<"Error mapping solution journal segment "<<path<<'\n';
+    close(fd);
+    return false;
+  }
+  seg.index = index;
+  seg.fd = fd;
+  seg.base = (unsigned char*)base;
+  seg.size = size;
+  seg.write_offset = sizeof(SegmentHeader);
+  seg.outstanding = 0;
+  seg.dirty = false;
+  seg.has_context = false;
+
+  SegmentHeader* sh = (SegmentHeader*)seg.base;
+  if (created or 0 != std::memcmp(sh->magic, journal_magic, sizeof(journal_magic))) {
+    if (not created) {
+      std::cerr<<"Discarding unrecognized solution journal segment "<<path<<'\n';
+    }
+    std::memcpy(sh->magic, journal_magic, sizeof(journal_magic));
+    sh->version = journal_version;
+    sh->generation = 1;
+    sh->read_offset = sizeof(SegmentHeader);
+    sh->reserved = 0;
+    //Mark the first record slot as empty
+    std::memset(seg.base + sizeof(SegmentHeader), 0, sizeof(RecordHeader));
+    seg.dirty = true;
+  }
+  return true;
+}
+
+void SolutionJournal::closeSegment(Segment& seg, bool remove) {
+  munmap(seg.base, seg.size);
+  close(seg.fd);
+  if (remove) {
+    unlink(segmentPath(seg.index).c_str());
+  }
+}
+
+void SolutionJournal::scanSegment(Segment& seg, std::vector<UnsentRecord>* unsent) {
+  SegmentHeader* sh = (SegmentHeader*)seg.base;
+  //Start at the beginning since context records may precede the read offset
+  size_t offset = sizeof(SegmentHeader);
+  Context current;
+  seg.outstanding = 0;
+  while (offset + sizeof(RecordHeader) <= seg.size) {
+    RecordHeader* rh = (RecordHeader*)(seg.base + offset);
+    unsigned char* data = seg.base + offset + sizeof(RecordHeader);
+    //Stop at the first empty, stale, or torn record
+    if (0 == rh->length or rh->generation != sh->generation or
+        offset + sizeof(RecordHeader) + rh->length > seg.size or
+        rh->checksum != recordChecksum(*rh, data)) {
+      break;
+    }
+    if (record_context == rh->state) {
+      current = std::make_shared<const std::vector<unsigned char>>(data, data + rh->length);
+    }
+    else if (record_unsent == rh->state) {
+      ++seg.outstanding;
+      if (unsent) {
+        unsent->push_back(UnsentRecord{makeID(seg.index, offset),
+              std::vector<unsigned char>(data, data + rh->length), current});
+      }
+    }
+    offset += recordSize(rh->length);
+  }
+  seg.write_offset = offset;
+}
+
+void SolutionJournal::advance(std::deque<Segment>::iterator seg) {
+  SegmentHeader* sh = (SegmentHeader*)seg->base;
+  size_t offset = sh->read_offset;
+  while (offset < seg->write_offset) {
+    RecordHeader* rh = (RecordHeader*)(seg->base + offset);
+    if (record_unsent == rh->state) {
+      break;
+    }
+    offset += recordSize(rh->length);
+  }
+  sh->read_offset = offset;
+  seg->dirty = true;
+
+  if (0 == seg->outstanding) {
+    if (seg + 1 != segments.end()) {
+      //Older segments are removed once everything in them was sent
+      closeSegment(*seg, true);
+      segments.erase(seg);
+    }
+    else {
+      //Reuse the newest segment from the beginning
+      ++sh->generation;
+      sh->read_offset = sizeof(SegmentHeader);
+      seg->write_offset = sizeof(SegmentHeader);
+      seg->has_context = false;
+    }
+  }
+}
+
+SolutionJournal::SolutionJournal(const std::string& directory, size_t segment_size) :
+  directory(directory), segment_size(std::max(segment_size, (size_t)4096)), next_index(0),
+  segments_created(0), valid(false) {
+  mkdir(directory.c_str(), 0755);
+  DIR* dir = opendir(directory.c_str());
+  if (nullptr == dir) {
+    std::cerr<<"Cannot open solution journal directory "<<directory<<'\n';
+    return;
+  }
+  //Find segments left behind by a previous process
+  std::vector<uint32_t> indices;
+  std::string prefix(segment_prefix);
+  std::string suffix(segment_suffix);
+  while (struct dirent* entry = readdir(dir)) {
+    std::string name(entry->d_name);
+    if (name.size() > prefix.size() + suffix.size() and
+        0 == name.compare(0, prefix.size(), prefix) and
+        0 == name.compare(name.size() - suffix.size(), suffix.size(), suffix)) {
+      try {
+        indices.push_back(std::stoul(name.substr(prefix.size(), name.size() - prefix.size() - suffix.size())));
+      }
+      catch (std::exception& err) {
+        //Not one of our segment files
+      }
+    }
+  }
+  closedir(dir);
+  std::sort(indices.begin(), indices.end());
+
+  for (uint32_t index : indices) {
+    next_index = index + 1;
+    //A crash can leave a segment that was never given a header
+    struct stat st;
+    if (0 == stat(segmentPath(index).c_str(), &st) and
+        (size_t)st.st_size < sizeof(SegmentHeader) + sizeof(RecordHeader)) {
+      unlink(segmentPath(index).c_str());
+      continue;
+    }
+    Segment seg;
+    if (mapSegment(index, 0, seg)) {
+      scanSegment(seg, nullptr);
+      segments.push_back(seg);
+    }
+  }
+  //Remove old segments that were completely sent
+  for (auto I = segments.begin(); I != segments.end() and I + 1 != segments.end();) {
+    if (0 == I->outstanding) {
+      closeSegment(*I, true);
+      I = segments.erase(I);
+    }
+    else {
+      ++I;
+    }
+  }
+  if (segments.empty()) {
+    Segment seg;
+    if (not mapSegment(next_index++, this->segment_size, seg)) {
+      return;
+    }
+    segments.push_back(seg);
+  }
+  valid = true;
+}
+
+SolutionJournal::~SolutionJournal() {
+  commit();
+  for (Segment& seg : segments) {
+    closeSegment(seg, false);
+  }
+}
+
+SolutionJournal::operator bool() const {
+  return valid;
+}
+
+std::vector<SolutionJournal::UnsentRecord> SolutionJournal::unsent() {
+  std::unique_lock<std::mutex> lck(journal_mutex);
+  std::vector<UnsentRecord> records;
+  for (Segment& seg : segments) {
+    scanSegment(seg, &records);
+  }
+  return records;
+}
+
+SolutionJournal::RecordID SolutionJournal::append(const std::vector<unsigned char>& message) {
+  struct iovec piece;
+  piece.iov_base = (void*)message.data();
+  piece.iov_len = message.size();
+  return append(&piece, 1);
+}
+
+void SolutionJournal::setContext(const std::vector<unsigned char>& context) {
+  std::unique_lock<std::mutex> lck(journal_mutex);
+  this->context = context;
+  //Records appended from now on need the new context ahead of them
+  if (not segments.empty()) {
+    segments.back().has_context = false;
+  }
+}
+
+SolutionJournal::Segment& SolutionJournal::segmentFor(size_t needed) {
+  //Leave room for an empty record header that terminates the segment
+  if (segments.back().write_offset + needed + sizeof(RecordHeader) > segments.back().size) {
+    Segment seg;
+    size_t min_size = std::max(segment_size, sizeof(SegmentHeader) + needed + sizeof(RecordHeader));
+    if (not mapSegment(next_index, min_size, seg)) {
+      throw std::runtime_error("Cannot create solution journal segment");
+    }
+    ++next_index;
+    ++segments_created;
+    segments.push_back(seg);
+  }
+  return segments.back();
+}
+
+SolutionJournal::RecordID SolutionJournal::writeRecord(Segment& seg, const struct iovec* pieces, size_t count, uint32_t state) {
+  size_t length = 0;
+  for (size_t p = 0; p < count; ++p) {
+    length += pieces[p].iov_len;
+  }
+  size_t needed = recordSize(length);
+  SegmentHeader* sh = (SegmentHeader*)seg.base;
+  size_t offset = seg.write_offset;
+  unsigned char* data = seg.base + offset + sizeof(RecordHeader);
+  unsigned char* out = data;
+  for (size_t p = 0; p < count; ++p) {
+    out = std::copy((unsigned char*)pieces[p].iov_base, (unsigned char*)pieces[p].iov_base + pieces[p].iov_len, out);
+  }
+  //Terminate the record list before the new record becomes valid
+  std::memset(seg.base + offset + needed, 0, sizeof(RecordHeader));
+  RecordHeader* rh = (RecordHeader*)(seg.base + offset);
+  rh->state = state;
+  rh->generation = sh->generation;
+  rh->length = length;
+  rh->checksum = recordChecksum(*rh, data);
+  seg.write_offset += needed;
+  seg.dirty = true;
+  return makeID(seg.index, offset);
+}
+
+SolutionJournal::RecordID SolutionJournal::append(const struct iovec* pieces, size_t count) {
+  size_t length = 0;
+  for (size_t p = 0; p < count; ++p) {
+    length += pieces[p].iov_len;
+  }
+  std::unique_lock<std::mutex> lck(journal_mutex);
+  //The context must be in the same segment as the record so that it
+  //survives exactly as long as the records that need it
+  size_t needed = recordSize(length);
+  bool write_context = not context.empty();
+  if (write_context) {
+    needed += recordSize(context.size());
+  }
+  Segment& seg = segmentFor(needed);
+  if (write_context and not seg.has_context) {
+    struct iovec piece;
+    piece.iov_base = (void*)context.data();
+    piece.iov_len = context.size();
+    writeRecord(seg, &piece, 1, record_context);
+    seg.has_context = true;
+  }
+  RecordID id = writeRecord(seg, pieces, count, record_unsent);
+  ++seg.outstanding;
+  return id;
+}
+
+void SolutionJournal::commit(bool wait) {
+  std::unique_lock<std::mutex> lck(journal_mutex);
+  for (Segment& seg : segments) {
+    if (seg.dirty) {
+      msync(seg.base, std::min(seg.size, seg.write_offset + sizeof(RecordHeader)),
+          wait ? MS_SYNC : MS_ASYNC);
+      seg.dirty = false;
+    }
+  }
+}
+
+void SolutionJournal::release(RecordID id) {
+  std::unique_lock<std::mutex> lck(journal_mutex);
+  uint32_t index = id >> 32;
+  size_t offset = id & 0xFFFFFFFF;
+  auto seg = std::find_if(segments.begin(), segments.end(),
+      [&](const Segment& s) { return s.index == index;});
+  if (seg == segments.end() or offset + sizeof(RecordHeader) > seg->write_offset) {
+    return;
+  }
+  RecordHeader* rh = (RecordHeader*)(seg->base + offset);
+  if (record_unsent == rh->state) {
+    rh->state = record_sent;
+    --seg->outstanding;
+    advance(seg);
+  }
+}
+
+size_t SolutionJournal::pending() {
+  std::unique_lock<std::mutex> lck(journal_mutex);
+  size_t total = 0;
+  for (Segment& seg : segments) {
+    total += seg.outstanding;
+  }
+  return total;
+}
+
+uint64_t SolutionJournal::segmentsCreated() {
+  std::unique_lock<std::mutex> lck(journal_mutex);
+  return segments_created;
+}
@@ -26,39 +26,331 @@
 #include "solver_world_connection.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <random>
+#include <stdexcept>
 #include <string>
 #include <tuple>
 #include <unistd.h>
 #include <vector>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
-//Send a handshake and a type declaration message.
-bool SolverWorldModel::reconnect() {
-  if (s) {
-    std::cout<<"Connected to the GRAIL world model.\n";
-  } else {
-    //Otherwise try to make a new connection
-    ClientSocket s2(AF_INET, SOCK_STREAM, 0, port, ip);
-    if (not s2) {
-      std::cerr<<"Failed to connect to the GRAIL world model.\n";
+namespace {
+  ///Payloads at least this large are referenced rather than copied when encoding
+  const size_t gather_threshold = 1024;
+
+  uint64_t elapsedNanoseconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+
+  ///A keep alive is only a length of one and its message ID
+  unsigned char keep_alive_msg[] = {0, 0, 0, 1, (unsigned char)world_model::solver::MessageID::keep_alive};
+  const struct iovec keep_alive_piece = {keep_alive_msg, sizeof(keep_alive_msg)};
+
+  ///Give up on a connection attempt after this many milliseconds
+  const int connect_timeout = 2000;
+  ///Give up on the handshake after this many milliseconds
+  const int handshake_timeout = 2000;
+  ///First delay after every endpoint failed, doubled after each failure
+  const std::chrono::milliseconds initial_backoff(250);
+  ///Longest delay between rounds of connection attempts
+  const std::chrono::milliseconds max_backoff(8000);
+
+  ///The solver whose receive thread is running on this thread, if any
+  thread_local const SolverWorldModel* receiving_for = nullptr;
+
+  /**
+   * Open a TCP connection and return its file descriptor, or -1 on failure.
+   * The connect is non-blocking so an unreachable host fails after
+   * connect_timeout milliseconds instead of the kernel's SYN timeout.
+   */
+  int connectSocket(const std::string& ip, uint16_t port) {
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* results = nullptr;
+    if (0 != getaddrinfo(ip.c_str(), std::to_string(port).c_str(), &hints, &results)) {
+      return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* ai = results; ai != nullptr and 0 > fd; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (0 > fd) {
+        continue;
+      }
+      int flags = fcntl(fd, F_GETFL, 0);
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+      int err = 0;
+      if (0 != connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+        err = errno;
+        if (EINPROGRESS == err) {
+          struct pollfd pfd{fd, POLLOUT, 0};
+          socklen_t len = sizeof(err);
+          if (1 != poll(&pfd, 1, connect_timeout) or
+              0 != getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len)) {
+            err = ETIMEDOUT;
+          }
+        }
+      }
+      if (0 != err) {
+        close(fd);
+        fd = -1;
+      }
+      else {
+        //Writes block again once connected
+        fcntl(fd, F_SETFL, flags);
+      }
+    }
+    freeaddrinfo(results);
+    return fd;
+  }
+
+  ///Set the send and receive timeouts of a socket, 0 to block forever
+  void setTimeouts(int fd, int milliseconds) {
+    struct timeval tv;
+    tv.tv_sec = milliseconds / 1000;
+    tv.tv_usec = (milliseconds % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  }
+
+  /**
+   * Write every piece of a gather list to a socket, continuing after
+   * partial writes. Throws std::runtime_error if the socket fails.
+   */
+  void sendPieces(int fd, const struct iovec* pieces, size_t count) {
+    const size_t max_chunk = 64;
+    struct iovec chunk[max_chunk];
+    size_t piece = 0;
+    size_t offset = 0;
+    while (piece < count) {
+      //Gather the remaining pieces, skipping the bytes that were already sent
+      size_t chunk_size = 0;
+      for (size_t p = piece; p < count and chunk_size < max_chunk; ++p) {
+        size_t skip = (p == piece) ? offset : 0;
+        chunk[chunk_size].iov_base = (unsigned char*)pieces[p].iov_base + skip;
+        chunk[chunk_size].iov_len = pieces[p].iov_len - skip;
+        ++chunk_size;
+      }
+      struct msghdr msg;
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = chunk;
+      msg.msg_iovlen = chunk_size;
+      ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+      if (0 > sent) {
+        if (EINTR == errno) {
+          continue;
+        }
+        else if (EAGAIN == errno or EWOULDBLOCK == errno) {
+          struct pollfd pfd{fd, POLLOUT, 0};
+          poll(&pfd, 1, -1);
+          continue;
+        }
+        throw std::runtime_error(std::string("error sending data: ") + std::strerror(errno));
+      }
+      //Advance past the bytes that were written
+      size_t remaining = sent;
+      while (piece < count and remaining >= pieces[piece].iov_len - offset) {
+        remaining -= pieces[piece].iov_len - offset;
+        offset = 0;
+        ++piece;
+      }
+      offset += remaining;
+    }
+  }
+
+  ///Write a value into a buffer in network byte order and advance the pointer
+  template<typename T>
+  void writeNetOrder(unsigned char*& out, T val) {
+    for (int shift = 8 * (sizeof(T) - 1); shift >= 0; shift -= 8) {
+      *out++ = (unsigned char)((uint64_t)val >> shift);
+    }
+  }
+
+  ///Append a value to a buffer in network byte order
+  template<typename T>
+  void appendNetOrder(std::vector<unsigned char>& buff, T val) {
+    for (int shift = 8 * (sizeof(T) - 1); shift >= 0; shift -= 8) {
+      buff.push_back((unsigned char)((uint64_t)val >> shift));
+    }
+  }
+
+  /**
+   * Read a value in network byte order and advance the offset.
+   * Returns false if the buffer is too short.
+   */
+  template<typename T>
+  bool readNetOrder(const std::vector<unsigned char>& buff, size_t& offset, T& val) {
+    if (buff.size() < offset + sizeof(T)) {
       return false;
     }
-    else {
-      s = std::move(s2);
+    uint64_t v = 0;
+    for (size_t i = 0; i < sizeof(T); ++i) {
+      v = (v << 8) | buff[offset++];
+    }
+    val = (T)v;
+    return true;
+  }
+
+  /**
+   * Encode the alias of every type with its name so that journaled
+   * messages can be mapped onto the aliases of a later process.
+   */
+  std::vector<unsigned char> encodeTypeTable(const std::vector<world_model::solver::AliasType>& types) {
+    std::vector<unsigned char> table;
+    appendNetOrder<uint32_t>(table, types.size());
+    for (const world_model::solver::AliasType& at : types) {
+      appendNetOrder<uint32_t>(table, at.alias);
+      appendNetOrder<uint32_t>(table, at.type.size());
+      for (char16_t c : at.type) {
+        appendNetOrder<uint16_t>(table, c);
+      }
+    }
+    return table;
+  }
+
+  ///Start a solver message in @buff and return the offset of its length
+  size_t beginMessage(std::vector<unsigned char>& buff, world_model::solver::MessageID id) {
+    size_t start = buff.size();
+    appendNetOrder<uint32_t>(buff, 0);
+    appendNetOrder<uint8_t>(buff, (uint8_t)id);
+    return start;
+  }
+
+  ///Fill in the length of the message that starts at @start
+  void endMessage(std::vector<unsigned char>& buff, size_t start) {
+    unsigned char* out = buff.data() + start;
+    writeNetOrder<uint32_t>(out, buff.size() - start - 4);
+  }
+
+  ///Append a UTF16 string preceded by its length in bytes
+  void appendSizedUTF16(std::vector<unsigned char>& buff, const std::u16string& str) {
+    appendNetOrder<uint32_t>(buff, 2 * str.size());
+    for (char16_t c : str) {
+      appendNetOrder<uint16_t>(buff, c);
+    }
+  }
+
+  ///Append a UTF16 string that runs to the end of the message
+  void appendUTF16(std::vector<unsigned char>& buff, const std::u16string& str) {
+    for (char16_t c : str) {
+      appendNetOrder<uint16_t>(buff, c);
+    }
+  }
+
+  /**
+   * Append a URI or attribute change to @buff with the same layout as the
+   * matching world_model::solver::make* function, without building a
+   * separate message first.
+   */
+  void encodeURIOperation(std::vector<unsigned char>& buff, SolverWorldModel::URIOperation::Kind kind,
+      const world_model::URI& uri, const std::u16string& name, world_model::grail_time time,
+      const std::u16string& origin) {
+    using world_model::solver::MessageID;
+    typedef SolverWorldModel::URIOperation::Kind Kind;
+    size_t start = 0;
+    switch (kind) {
+      case Kind::create_uri:
+        start = beginMessage(buff, MessageID::create_uri);
+        appendSizedUTF16(buff, uri);
+        appendNetOrder<uint64_t>(buff, time);
+        appendUTF16(buff, origin);
+        break;
+      case Kind::expire_uri:
+        start = beginMessage(buff, MessageID::expire_uri);
+        appendSizedUTF16(buff, uri);
+        appendNetOrder<uint64_t>(buff, time);
+        appendUTF16(buff, origin);
+        break;
+      case Kind::delete_uri:
+        start = beginMessage(buff, MessageID::delete_uri);
+        appendSizedUTF16(buff, uri);
+        appendUTF16(buff, origin);
+        break;
+      case Kind::expire_attribute:
+        start = beginMessage(buff, MessageID::expire_attribute);
+        appendSizedUTF16(buff, uri);
+        appendSizedUTF16(buff, name);
+        appendSizedUTF16(buff, origin);
+        appendNetOrder<uint64_t>(buff, time);
+        break;
+      case Kind::delete_attribute:
+        start = beginMessage(buff, MessageID::delete_attribute);
+        appendSizedUTF16(buff, uri);
+        appendSizedUTF16(buff, name);
+        appendSizedUTF16(buff, origin);
+        break;
+    }
+    endMessage(buff, start);
+  }
+
+  /**
+   * Append a type announcement for types[first, last) with the same
+   * layout as world_model::solver::makeTypeAnnounceMsg.
+   */
+  void encodeTypeAnnounce(std::vector<unsigned char>& buff,
+      const std::vector<world_model::solver::AliasType>& types,
+      size_t first, size_t last, const std::u16string& origin) {
+    size_t start = beginMessage(buff, world_model::solver::MessageID::type_announce);
+    appendNetOrder<uint32_t>(buff, last - first);
+    for (size_t t = first; t < last; ++t) {
+      appendNetOrder<uint32_t>(buff, types[t].alias);
+      appendSizedUTF16(buff, types[t].type);
+      appendNetOrder<uint8_t>(buff, types[t].on_demand ? 1 : 0);
+    }
+    appendUTF16(buff, origin);
+    endMessage(buff, start);
+  }
+
+  ///Decode a table from encodeTypeTable. Returns false if it is malformed.
+  bool decodeTypeTable(const std::vector<unsigned char>& table, std::map<uint32_t, std::u16string>& names) {
+    size_t offset = 0;
+    uint32_t count = 0;
+    if (not readNetOrder(table, offset, count)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t alias = 0;
+      uint32_t length = 0;
+      if (not readNetOrder(table, offset, alias) or
+          not readNetOrder(table, offset, length) or
+          table.size() < offset + 2 * (size_t)length) {
+        return false;
+      }
+      std::u16string name(length, u'\0');
+      for (char16_t& c : name) {
+        uint16_t val = 0;
+        readNetOrder(table, offset, val);
+        c = val;
+      }
+      names[alias] = name;
     }
+    return true;
   }
+}
 
+bool SolverWorldModel::announce(ClientSocket& sock) {
   //Try to get the handshake message
-  {
+  try {
     std::vector<unsigned char> handshake = world_model::solver::makeHandshakeMsg();
 
     //Send the handshake message
-    s.send(handshake);
+    sock.send(handshake);
     std::vector<unsigned char> raw_message(handshake.size());
-    size_t length = s.receive(raw_message);
+    size_t length = sock.receive(raw_message);
 
     //Check if the handshake message failed
     if (not (length == handshake.size() and
@@ -67,64 +359,325 @@ bool SolverWorldModel::reconnect() {
       return false;
     }
   }
+  catch (std::runtime_error& err) {
+    std::cerr<<"Problem during solver handshake: "<<err.what()<<'\n';
+    return false;
+  }
 
-  //Send the type announcement message
+  //Send the type announcement message, including types added since the
+  //first connection
+  std::vector<unsigned char> announcement;
+  {
+    std::unique_lock<std::mutex> lck(trans_mutex);
+    encodeTypeAnnounce(announcement, types, 0, types.size(), origin);
+  }
   try {
-    s.send(world_model::solver::makeTypeAnnounceMsg(types, origin));
+    sock.send(announcement);
   }
-  catch (std::runtime_error err) {
+  catch (std::runtime_error& err) {
     std::cerr<<"Problem sending type announce message: "<<err.what()<<'\n';
     return false;
   }
+  return true;
+}
+
+void SolverWorldModel::lostConnection() {
+  if (ConnectionState::connected == state) {
+    //Wake the receive thread. The connection thread replaces the socket.
+    shutdown(sock_fd, SHUT_RDWR);
+    //Start with the next endpoint since this one failed
+    endpoint = (endpoint + 1) % endpoints.size();
+    state = ConnectionState::disconnected;
+    connection_cv.notify_all();
+  }
+}
+
+bool SolverWorldModel::waitConnected() {
+  //The receive thread only flags a lost connection if it cannot take
+  //send_mutex, so check the flag before every write. Otherwise the write
+  //would go into a dead socket and look like it succeeded.
+  auto ready = [&]() {
+    if (connection_lost.exchange(false)) {
+      lostConnection();
+    }
+    return stopping.load() or ConnectionState::connected == state;
+  };
+  //The connection thread waits for the receive thread before reconnecting,
+  //so a send from an on_demand callback must not wait for it.
+  if (not ready() and receiving_for == this) {
+    return false;
+  }
+  //Waiting releases send_mutex so the connection thread can install a socket
+  connection_cv.wait(send_mutex, ready);
+  return ConnectionState::connected == state;
+}
 
-  //Clear the old thread if one was running
+void SolverWorldModel::stopTracker() {
   if (running) {
     interrupted = true;
     on_demand_tracker.join();
+    running = false;
   }
+}
 
-  ss.previous_unfinished.clear();
-  running = true;
-  interrupted = false;
-  //Start the on_demand status tracking thread
-  on_demand_tracker = std::thread(std::mem_fun(&SolverWorldModel::trackOnDemands), this);
-  return true;
+void SolverWorldModel::manageConnection() {
+  std::minstd_rand jitter(std::random_device{}());
+  std::chrono::milliseconds backoff = initial_backoff;
+  std::unique_lock<std::mutex> lck(send_mutex);
+  while (not stopping) {
+    if (ConnectionState::connected == state) {
+      connection_cv.wait(lck);
+      continue;
+    }
+    state = ConnectionState::connecting;
+    size_t first = endpoint;
+    lck.unlock();
+    //The receive thread of the old connection must finish before its
+    //socket is replaced
+    stopTracker();
+
+    //Try each endpoint once, starting with the one that should be used next.
+    //The descriptor is kept so that messages can be written with a gather list.
+    ClientSocket s2(port, ip, -1);
+    int fd = -1;
+    size_t index = first;
+    for (size_t attempt = 0; attempt < endpoints.size() and not stopping; ++attempt) {
+      index = (first + attempt) % endpoints.size();
+      const Endpoint& ep = endpoints[index];
+      fd = connectSocket(ep.first, ep.second);
+      s2 = ClientSocket(ep.second, ep.first, fd);
+      if (not s2) {
+        std::cerr<<"Failed to connect to the GRAIL world model at "<<ep.first<<':'<<ep.second<<".\n";
+        fd = -1;
+        continue;
+      }
+      state = ConnectionState::handshaking;
+      setTimeouts(fd, handshake_timeout);
+      if (announce(s2)) {
+        setTimeouts(fd, 0);
+        break;
+      }
+      s2 = ClientSocket(ep.second, ep.first, -1);
+      fd = -1;
+      state = ConnectionState::connecting;
+    }
+
+    lck.lock();
+    if (0 <= fd) {
+      std::cout<<"Connected to the GRAIL world model.\n";
+      s = std::move(s2);
+      sock_fd = fd;
+      endpoint = index;
+      ip = endpoints[index].first;
+      port = endpoints[index].second;
+      {
+        //A new connection may be to a world model without the old values
+        std::unique_lock<std::mutex> trans_lck(trans_mutex);
+        last_sent.clear();
+      }
+      ss.previous_unfinished.clear();
+      //Anything queued by the old receive thread was about the old socket
+      connection_lost = false;
+      keep_alive_pending = false;
+      running = true;
+      interrupted = false;
+      //Start the on_demand status tracking thread
+      on_demand_tracker = std::thread(std::mem_fun(&SolverWorldModel::trackOnDemands), this);
+      state = ConnectionState::connected;
+      backoff = initial_backoff;
+      connection_cv.notify_all();
+    }
+    else if (not stopping) {
+      //Every endpoint failed. Wait between half and all of the backoff so
+      //that solvers restarted together do not retry together.
+      state = ConnectionState::backoff;
+      std::uniform_int_distribution<int64_t> spread(0, backoff.count() / 2);
+      std::chrono::milliseconds delay(backoff.count() - backoff.count() / 2 + spread(jitter));
+      connection_cv.wait_for(lck, delay, [&]() { return stopping.load(); });
+      backoff = std::min(backoff * 2, max_backoff);
+      state = ConnectionState::disconnected;
+    }
+  }
 }
 
 void SolverWorldModel::sendAndReconnect(const std::vector<unsigned char>& buff) {
+  struct iovec piece;
+  piece.iov_base = (void*)buff.data();
+  piece.iov_len = buff.size();
+  sendAndReconnect(&piece, 1);
+}
+
+void SolverWorldModel::sendAndReconnect(const struct iovec* pieces, size_t count) {
+  size_t bytes = 0;
+  for (size_t p = 0; p < count; ++p) {
+    bytes += pieces[p].iov_len;
+  }
+  message_bytes.record(bytes);
+  auto start = std::chrono::steady_clock::now();
   bool sent = false;
-  bool first_wait = true;
-  int wait_time = 1;
+  size_t attempts = 0;
   while (not sent) {
-    if (not first_wait) {
-      //std::cerr<<"Sleeping for "<<wait_time<<" seconds\n";
-      sleep(wait_time);
-      wait_time = 8;
+    ++attempts;
+    if (not waitConnected()) {
+      throw std::runtime_error("solver is not connected to the world model");
     }
-    //std::cerr<<"Checking connection\n";
-    if (not s) {
-      //std::cerr<<"Trying to reconnect\n";
-      reconnect();
+    try {
+      auto write_start = std::chrono::steady_clock::now();
+      sendPieces(sock_fd, pieces, count);
+      sent = true;
+      socket_write.record(elapsedNanoseconds(write_start));
     }
-    else {
+    catch (std::runtime_error& err) {
+      std::cerr<<"Problem with solver world model connection: "<<err.what()<<'\n';
+      //Part of the message may have been written so the connection
+      //cannot be reused. The whole message is sent again once the
+      //connection thread has connected to the next endpoint.
+      lostConnection();
+    }
+  }
+  //Only sends that needed more than one attempt count as retries
+  if (1 < attempts) {
+    retry.record(elapsedNanoseconds(start));
+  }
+}
+
+SolverWorldModel::SendLock::SendLock(SolverWorldModel* swm, std::unique_lock<std::mutex>&& lck) :
+  swm(swm), lck(std::move(lck)) {
+}
+
+SolverWorldModel::SendLock::SendLock(SendLock&& other) :
+  swm(other.swm), lck(std::move(other.lck)) {
+}
+
+SolverWorldModel::SendLock::~SendLock() {
+  if (lck.owns_lock()) {
+    swm->releaseSend(lck);
+  }
+}
+
+SolverWorldModel::SendLock SolverWorldModel::lockSend() {
+  auto start = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lck(send_mutex);
+  lock_wait.record(elapsedNanoseconds(start));
+  return SendLock(this, std::move(lck));
+}
+
+void SolverWorldModel::releaseSend(std::unique_lock<std::mutex>& lck) {
+  do {
+    if (connection_lost.exchange(false)) {
+      lostConnection();
+    }
+    //Keep alives go out between messages but are never worth a reconnect
+    if (keep_alive_pending.exchange(false) and ConnectionState::connected == state) {
       try {
-        s.send(buff);
-        sent = true;
+        sendPieces(sock_fd, &keep_alive_piece, 1);
       }
       catch (std::runtime_error& err) {
-        std::cerr<<"Problem with solver world model connection: "<<err.what()<<'\n';
+        std::cerr<<"Problem sending keep alive: "<<err.what()<<'\n';
+        lostConnection();
       }
     }
-    first_wait = false;
+    lck.unlock();
+    //Work queued after the checks above is done by whoever holds the
+    //lock now, or by this thread if the lock is free.
+  } while ((keep_alive_pending or connection_lost) and lck.try_lock());
+}
+
+void SolverWorldModel::queueControl() {
+  std::unique_lock<std::mutex> lck(send_mutex, std::try_to_lock);
+  if (lck.owns_lock()) {
+    releaseSend(lck);
   }
 }
 
+SolverWorldModel::SendStatistics SolverWorldModel::sendStatistics() {
+  SendStatistics stats;
+  stats.lock_wait = lock_wait.snapshot();
+  stats.encode = encode.snapshot();
+  stats.socket_write = socket_write.snapshot();
+  stats.retry = retry.snapshot();
+  stats.message_bytes = message_bytes.snapshot();
+  return stats;
+}
+
 static std::string toString(const std::u16string& str) {
   return std::string(str.begin(), str.end());
 }
 
+///Compile an on_demand pattern, returning null if it is not a valid regex
+static std::shared_ptr<regex_t> compilePattern(const std::u16string& request) {
+  std::unique_ptr<regex_t> exp(new regex_t);
+  if (0 != regcomp(exp.get(), toString(request).c_str(), REG_EXTENDED)) {
+    return std::shared_ptr<regex_t>();
+  }
+  return std::shared_ptr<regex_t>(exp.release(), [](regex_t* r) { regfree(r); delete r; });
+}
+
+void SolverWorldModel::notifyOnDemand(const std::set<uint32_t>& changed) {
+  //Reports are captured and queued under one lock so that the queue holds
+  //them in the order of the changes
+  std::unique_lock<std::mutex> lck(trans_mutex);
+  if (not on_demand_callback) {
+    return;
+  }
+  for (uint32_t alias : changed) {
+    if (0 == alias or types.size() < alias) {
+      continue;
+    }
+    std::vector<std::u16string> requests;
+    for (const OnDemandArgs& ta : on_demand_on[alias]) {
+      requests.push_back(ta.request);
+    }
+    notify_queue.push_back(OnDemandReport(types[alias-1].type, requests));
+  }
+  notify_cv.notify_all();
+}
+
+void SolverWorldModel::notifyThread() {
+  std::deque<OnDemandReport> reports;
+  std::unique_lock<std::mutex> lck(trans_mutex);
+  while (not notify_stop) {
+    notify_cv.wait(lck, [&]() { return notify_stop or not notify_queue.empty(); });
+    reports.swap(notify_queue);
+    OnDemandCallback callback = on_demand_callback;
+    //Call back without holding trans_mutex so the solver may send data
+    lck.unlock();
+    for (OnDemandReport& report : reports) {
+      try {
+        callback(report.first, report.second);
+      }
+      catch (std::exception& err) {
+        std::cerr<<"Error in on_demand callback: "<<err.what()<<'\n';
+      }
+    }
+    reports.clear();
+    lck.lock();
+  }
+}
+
+void SolverWorldModel::setOnDemandCallback(OnDemandCallback callback) {
+  std::set<uint32_t> current;
+  {
+    std::unique_lock<std::mutex> lck(trans_mutex);
+    on_demand_callback = callback;
+    for (const world_model::solver::AliasType& at : types) {
+      if (at.on_demand) {
+        current.insert(at.alias);
+      }
+    }
+    if (not notify_thread.joinable()) {
+      notify_thread = std::thread(&SolverWorldModel::notifyThread, this);
+    }
+  }
+  //Report the current state since requests may have arrived already. The
+  //state is read when the report is queued, so it is at least as new as
+  //any report queued before it.
+  notifyOnDemand(current);
+}
+
 void SolverWorldModel::trackOnDemands() {
   using world_model::solver::MessageID;
+  receiving_for = this;
   //Continue processing packets while the connection is open
   try {
     while (not interrupted) {
@@ -134,8 +687,10 @@ void SolverWorldModel::trackOnDemands() {
         if (message_type == MessageID::start_on_demand) {
           std::vector<std::tuple<uint32_t, std::vector<std::u16string>>> trans =
             world_model::solver::decodeStartOnDemand(in_buff);
+          std::set<uint32_t> changed;
           std::unique_lock<std::mutex> lck(trans_mutex);
           for (auto I = trans.begin(); I != trans.end(); ++I) {
+            changed.insert(std::get<0>(*I));
             std::cerr<<"OnDemand "<<std::get<0>(*I)<<" has "<<std::get<1>(*I).size()<<" URI requests.\n";
             std::vector<std::u16string>& requests = std::get<1>(*I);
             for (std::u16string& request : requests) {
@@ -144,21 +699,21 @@ void SolverWorldModel::trackOnDemands() {
 
               OnDemandArgs ta;
               ta.request = request;
-              int err = regcomp(&ta.exp, toString(ta.request).c_str(), REG_EXTENDED);
-              if (0 != err) {
-                ta.valid = false;
+              ta.exp = compilePattern(ta.request);
+              if (not ta.exp) {
                 std::cerr<<"Error compiling regular expression "<<toString(ta.request)<<" in on_demand request to solver client.\n";
               }
-              else {
-                ta.valid = true;
-              }
               on_demand_on[std::get<0>(*I)].insert(ta);
             }
           }
+          publishOnDemand();
+          lck.unlock();
+          notifyOnDemand(changed);
         }
         else if (message_type == MessageID::stop_on_demand) {
           std::vector<std::tuple<uint32_t, std::vector<std::u16string>>> trans =
             world_model::solver::decodeStopOnDemand(in_buff);
+          std::set<uint32_t> changed;
           std::unique_lock<std::mutex> lck(trans_mutex);
           for (auto I = trans.begin(); I != trans.end(); ++I) {
             uint32_t attr_name = std::get<0>(*I);
@@ -171,22 +726,24 @@ void SolverWorldModel::trackOnDemands() {
                 auto J = std::find_if(uri_set.begin(), uri_set.end(),
                     [&](const OnDemandArgs& ta) { return ta.request == request;});
                 if (J != uri_set.end()) {
-                  OnDemandArgs ta = *J;
-                  if (ta.valid) {
-                    regfree(&ta.exp);
-                  }
+                  //The pattern is freed once no snapshot refers to it
                   uri_set.erase(J);
+                  changed.insert(attr_name);
                 }
               }
             }
           }
+          publishOnDemand();
+          lck.unlock();
+          notifyOnDemand(changed);
         }
         else if (message_type == MessageID::keep_alive) {
           //Send a keep alive message in reply to a keep alive from
           //the server. This makes sure that we are replying at less
-          //than the sever's timeout period.
-          std::unique_lock<std::mutex> lck(send_mutex);
-          sendAndReconnect(world_model::solver::makeKeepAlive());
+          //than the sever's timeout period. This never waits behind
+          //solutions that are being sent by other threads.
+          keep_alive_pending = true;
+          queueControl();
         }
       }
       else {
@@ -196,12 +753,43 @@ void SolverWorldModel::trackOnDemands() {
   }
   catch (std::exception& e) {
     std::cerr<<"Error with solver connection: "<<e.what()<<'\n';
+    if (not interrupted) {
+      //Let the connection thread know without waiting for a sender
+      connection_lost = true;
+      queueControl();
+    }
     return;
   }
 }
 
-SolverWorldModel::SolverWorldModel(std::string ip, uint16_t port, std::vector<std::pair<std::u16string, bool>>& types, std::u16string origin) : s(AF_INET, SOCK_STREAM, 0, port, ip), ss(s) {
+SolverWorldModel::SolverWorldModel(std::string ip, uint16_t port, std::vector<std::pair<std::u16string, bool>>& types, std::u16string origin) :
+  SolverWorldModel(std::vector<Endpoint>{Endpoint(ip, port)}, types, origin) {
+}
+
+SolverWorldModel::SolverWorldModel(const std::vector<Endpoint>& endpoints, std::vector<std::pair<std::u16string, bool>>& types, std::u16string origin) :
+  s(endpoints.empty() ? 0 : endpoints.front().second, endpoints.empty() ? "" : endpoints.front().first, -1), ss(s) {
+  if (endpoints.empty()) {
+    throw std::invalid_argument("SolverWorldModel needs at least one world model endpoint");
+  }
+  this->endpoints = endpoints;
+  endpoint = 0;
   running = false;
+  stopping = false;
+  state = ConnectionState::disconnected;
+  sock_fd = -1;
+  keep_alive_pending = false;
+  connection_lost = false;
+  suppress_unchanged = false;
+  refresh_interval = 0;
+  max_sent_values = 1 << 20;
+  suppressed = 0;
+  coalesce_window = 0;
+  notify_stop = false;
+  send_allocations = 0;
+  on_demand_snapshot = nullptr;
+  snapshot_readers[0] = 0;
+  snapshot_readers[1] = 0;
+  snapshot_epoch = 0;
   this->origin = origin;
   //Store the alias types that this solver will use
   for (auto I = types.begin(); I != types.end(); ++I) {
@@ -214,111 +802,897 @@ SolverWorldModel::SolverWorldModel(std::string ip, uint16_t port, std::vector<st
       }
     }
   }
+  publishOnDemand();
   //Store these values so that we can reconnect later
-  this->ip = ip;
-  this->port = port;
+  ip = endpoints.front().first;
+  port = endpoints.front().second;
 
-  reconnect();
+  //Connect in the background so that construction never blocks
+  connection_thread = std::thread(&SolverWorldModel::manageConnection, this);
 }
 
 SolverWorldModel::~SolverWorldModel() {
-  if (running) {
-    interrupted = true;
-    on_demand_tracker.join();
+  bool coalescing = false;
+  {
+    std::unique_lock<std::mutex> lck(trans_mutex);
+    coalescing = 0 < coalesce_window;
+    coalesce_window = 0;
+    coalesce_cv.notify_all();
+  }
+  {
+    //Sends fail rather than wait for a connection from now on, so neither
+    //the coalescing thread nor the last flush can block forever
+    std::unique_lock<std::mutex> lck(send_mutex);
+    stopping = true;
+    connection_cv.notify_all();
+  }
+  if (coalescing) {
+    coalesce_thread.join();
+    //The last window is only sent if the world model is still connected
+    try {
+      flush();
+    }
+    catch (std::runtime_error& err) {
+      std::cerr<<"Dropping the last coalesced updates: "<<err.what()<<'\n';
+    }
   }
+  connection_thread.join();
+  stopTracker();
+  {
+    std::unique_lock<std::mutex> lck(trans_mutex);
+    notify_stop = true;
+    notify_cv.notify_all();
+  }
+  if (notify_thread.joinable()) {
+    notify_thread.join();
+  }
+  delete on_demand_snapshot.load();
+}
+
+template<typename Encoder>
+void SolverWorldModel::sendControl(Encoder encode) {
+  std::unique_ptr<OutgoingFrame> frame = acquireFrame();
+  std::vector<unsigned char>& buff = frame->gather.headers;
+  size_t capacity = buff.capacity();
+  buff.clear();
+  encode(buff);
+  if (capacity != buff.capacity()) {
+    ++send_allocations;
+  }
+  {
+    SendLock lck = lockSend();
+    sendAndReconnect(buff);
+  }
+  releaseFrame(std::move(frame));
 }
 
-void SolverWorldModel::addTypes(std::vector<std::pair<std::u16string, bool>>& new_types) {
+std::vector<SolverWorldModel::TypeHandle> SolverWorldModel::addTypes(std::vector<std::pair<std::u16string, bool>>& new_types) {
   //Store the alias types that this solver will use
-	std::vector<world_model::solver::AliasType> new_aliases;
-  for (auto I = new_types.begin(); I != new_types.end(); ++I) {
-    world_model::solver::AliasType at{(uint32_t)(this->types.size()+1), I->first, I->second};
-    this->types.push_back(at);
-    aliases[at.type] = at.alias;
-    if (I->second) {
-      if (on_demand_on.end() == on_demand_on.find(at.alias)) {
-        on_demand_on[at.alias] = std::multiset<OnDemandArgs>();
+  std::vector<TypeHandle> handles;
+  size_t first = 0;
+  size_t last = 0;
+  {
+    std::unique_lock<std::mutex> lck(trans_mutex);
+    first = types.size();
+    for (auto I = new_types.begin(); I != new_types.end(); ++I) {
+      world_model::solver::AliasType at{(uint32_t)(this->types.size()+1), I->first, I->second};
+      this->types.push_back(at);
+      aliases[at.type] = at.alias;
+      if (I->second) {
+        if (on_demand_on.end() == on_demand_on.find(at.alias)) {
+          on_demand_on[at.alias] = std::multiset<OnDemandArgs>();
+        }
       }
+      handles.push_back(at.alias);
+    }
+    last = types.size();
+    publishOnDemand();
+    //Messages with the new aliases are journaled after the new table
+    if (journal) {
+      journal->setContext(encodeTypeTable(types));
     }
-		new_aliases.push_back(at);
   }
   //Update the world model with a new type announcement message
   try {
-    std::unique_lock<std::mutex> lck(send_mutex);
-    sendAndReconnect(world_model::solver::makeTypeAnnounceMsg(new_aliases, origin));
+    sendControl([&](std::vector<unsigned char>& buff) {
+        std::unique_lock<std::mutex> lck(trans_mutex);
+        encodeTypeAnnounce(buff, types, first, last, origin);
+      });
   }
   catch (std::runtime_error err) {
     std::cerr<<"Problem sending type announce message: "<<err.what()<<'\n';
   }
+  return handles;
 }
 
 bool SolverWorldModel::connected() {
-  if (s) {
+  return ConnectionState::connected == state;
+}
+
+bool SolverWorldModel::waitForConnection(world_model::grail_time timeout) {
+  std::unique_lock<std::mutex> lck(send_mutex);
+  connection_cv.wait_for(lck, std::chrono::milliseconds(timeout), [&]() {
+      return stopping.load() or ConnectionState::connected == state; });
+  return ConnectionState::connected == state;
+}
+
+SolverWorldModel::ConnectionState SolverWorldModel::connectionState() {
+  return state;
+}
+
+SolverWorldModel::SnapshotReader::SnapshotReader(SolverWorldModel& swm) {
+  //Register under the current epoch, retrying if a writer advanced it in
+  //between so that the writer knows to wait for this reader
+  for (;;) {
+    uint32_t epoch = swm.snapshot_epoch.load();
+    readers = &swm.snapshot_readers[epoch & 1];
+    ++*readers;
+    if (swm.snapshot_epoch.load() == epoch) {
+      break;
+    }
+    --*readers;
+  }
+  current = swm.on_demand_snapshot.load();
+}
+
+SolverWorldModel::SnapshotReader::~SnapshotReader() {
+  --*readers;
+}
+
+const SolverWorldModel::OnDemandSnapshot& SolverWorldModel::SnapshotReader::snapshot() const {
+  return *current;
+}
+
+void SolverWorldModel::publishOnDemand() {
+  std::unique_ptr<OnDemandSnapshot> snapshot(new OnDemandSnapshot());
+  for (const world_model::solver::AliasType& at : types) {
+    snapshot->aliases[at.type] = at.alias;
+    if (at.on_demand) {
+      std::vector<std::shared_ptr<regex_t>>& patterns = snapshot->patterns[at.alias];
+      for (const OnDemandArgs& ta : on_demand_on[at.alias]) {
+        if (ta.exp) {
+          patterns.push_back(ta.exp);
+        }
+      }
+    }
+  }
+  const OnDemandSnapshot* old = on_demand_snapshot.exchange(snapshot.release());
+  //Readers that could have loaded the old snapshot entered in the current
+  //epoch. Later readers see the new epoch and the new snapshot.
+  uint32_t epoch = snapshot_epoch++;
+  while (0 != snapshot_readers[epoch & 1].load()) {
+    std::this_thread::yield();
+  }
+  delete old;
+}
+
+bool SolverWorldModel::isRequested(const OnDemandSnapshot& snapshot, uint32_t alias, const world_model::URI& target,
+    std::atomic<uint64_t>* allocations) {
+  //Send if this is not an on_demand or it is an on_demand but is requested
+  auto I = snapshot.patterns.find(alias);
+  if (snapshot.patterns.end() == I) {
     return true;
   }
-  else {
+  if (I->second.empty()) {
     return false;
   }
+  //Find if any patterns match this information. The narrow copy of the URI
+  //reuses a per-thread buffer so that the send path does not allocate.
+  static thread_local std::string uri;
+  size_t capacity = uri.capacity();
+  uri.assign(target.begin(), target.end());
+  if (nullptr != allocations and capacity != uri.capacity()) {
+    ++*allocations;
+  }
+  return std::any_of(I->second.begin(), I->second.end(),
+      [&](const std::shared_ptr<regex_t>& exp) {
+      regmatch_t pmatch;
+      int match = regexec(exp.get(), uri.c_str(), 1, &pmatch, 0);
+      return (0 == match and 0 == pmatch.rm_so and uri.size() == pmatch.rm_eo); });
 }
 
-void SolverWorldModel::sendData(std::vector<AttrUpdate>& solution, bool create_uris) {
-  using world_model::solver::SolutionData;
-  std::vector<SolutionData> sds;
-  for (auto I = solution.begin(); I != solution.end(); ++I) {
-    std::unique_lock<std::mutex> lck(trans_mutex);
-    if (aliases.end() != aliases.find(I->type)) {
-      uint32_t alias = aliases[I->type];
-      //TODO Let the user check this themselves, it should be up to them
-      //whether or not to send data
-      //Send if this is not an on_demand or it is an on_demand but is requested
-      if (on_demand_on.end() == on_demand_on.find(alias)) {
-        SolutionData sd{alias, I->time, I->target, I->data};
-        sds.push_back(sd);
+bool SolverWorldModel::isRequested(const std::u16string& type, const world_model::URI& uri) {
+  SnapshotReader reader(*this);
+  const OnDemandSnapshot& snapshot = reader.snapshot();
+  auto I = snapshot.aliases.find(type);
+  if (snapshot.aliases.end() == I) {
+    return false;
+  }
+  return isRequested(snapshot, I->second, uri);
+}
+
+bool SolverWorldModel::isRequested(TypeHandle type, const world_model::URI& uri) {
+  SnapshotReader reader(*this);
+  const OnDemandSnapshot& snapshot = reader.snapshot();
+  if (0 == type or snapshot.aliases.size() < type) {
+    return false;
+  }
+  return isRequested(snapshot, type, uri);
+}
+
+uint64_t SolverWorldModel::sentKey(uint32_t alias, const world_model::URI& target) {
+  //FNV-1a hash of the alias and the URI
+  uint64_t key = 14695981039346656037ULL;
+  for (int shift = 0; shift < 32; shift += 8) {
+    key = (key ^ ((alias >> shift) & 0xFF)) * 1099511628211ULL;
+  }
+  for (char16_t c : target) {
+    key = (key ^ (c & 0xFF)) * 1099511628211ULL;
+    key = (key ^ (c >> 8)) * 1099511628211ULL;
+  }
+  return key;
+}
+
+bool SolverWorldModel::isUnchanged(uint32_t alias, const world_model::URI& target,
+    world_model::grail_time time, const std::vector<uint8_t>& data) {
+  //FNV-1a hash of the data
+  uint64_t data_hash = 14695981039346656037ULL;
+  for (uint8_t byte : data) {
+    data_hash = (data_hash ^ byte) * 1099511628211ULL;
+  }
+  uint64_t key = sentKey(alias, target);
+  auto I = last_sent.find(key);
+  if (I == last_sent.end()) {
+    //Bound the memory used by solvers with many short-lived URIs
+    if (max_sent_values <= last_sent.size()) {
+      last_sent.clear();
+    }
+    last_sent[key] = SentValue{data_hash, time};
+    ++send_allocations;
+    return false;
+  }
+  if (I->second.data_hash == data_hash and time - I->second.time < refresh_interval) {
+    ++suppressed;
+    return true;
+  }
+  I->second.data_hash = data_hash;
+  I->second.time = time;
+  return false;
+}
+
+void SolverWorldModel::forgetSent(const world_model::URI& uri, const std::u16string* type) {
+  std::unique_lock<std::mutex> lck(trans_mutex);
+  eraseSent(uri, type);
+}
+
+void SolverWorldModel::eraseSent(const world_model::URI& uri, const std::u16string* type) {
+  if (last_sent.empty()) {
+    return;
+  }
+  if (nullptr == type) {
+    //Only hashes are stored, so try every alias of the URI
+    for (const world_model::solver::AliasType& at : types) {
+      last_sent.erase(sentKey(at.alias, uri));
+    }
+  }
+  else {
+    auto I = aliases.find(*type);
+    if (aliases.end() != I) {
+      last_sent.erase(sentKey(I->second, uri));
+    }
+  }
+}
+
+void SolverWorldModel::suppressUnchanged(bool enable, world_model::grail_time refresh_interval, size_t max_entries) {
+  std::unique_lock<std::mutex> lck(trans_mutex);
+  suppress_unchanged = enable;
+  this->refresh_interval = refresh_interval;
+  max_sent_values = std::max(max_entries, (size_t)1);
+  if (not enable) {
+    last_sent.clear();
+  }
+}
+
+uint64_t SolverWorldModel::suppressedCount() {
+  return suppressed;
+}
+
+size_t SolverWorldModel::pendingSlot(uint32_t alias, const world_model::URI& target) {
+  size_t mask = pending_slots.size() - 1;
+  size_t slot = (std::hash<world_model::URI>()(target) ^ (alias * 0x9E3779B97F4A7C15ULL)) & mask;
+  while (0 != pending_slots[slot]) {
+    const PendingUpdate& pu = pending[pending_slots[slot] - 1];
+    if (pu.alias == alias and pu.update.target == target) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+void SolverWorldModel::coalesce(uint32_t alias, world_model::grail_time time, world_model::URI& target,
+    std::vector<uint8_t>& data, bool create_uris, bool movable) {
+  //Keep the table at most half full so that probe sequences stay short
+  if (pending_slots.size() < 2 * (pending.size() + 1)) {
+    ++send_allocations;
+    pending_slots.assign(std::max((size_t)64, 2 * pending_slots.size()), 0);
+    for (size_t idx = 0; idx < pending.size(); ++idx) {
+      pending_slots[pendingSlot(pending[idx].alias, pending[idx].update.target)] = idx + 1;
+    }
+  }
+  size_t slot = pendingSlot(alias, target);
+  if (0 == pending_slots[slot]) {
+    pending_slots[slot] = pending.size() + 1;
+    if (pending.size() == pending.capacity()) {
+      ++send_allocations;
+    }
+    if (movable) {
+      pending.push_back(PendingUpdate{alias, AttrUpdate{std::u16string(), time, std::move(target), std::move(data)}, create_uris});
+    }
+    else {
+      pending.push_back(PendingUpdate{alias, AttrUpdate{std::u16string(), time, target, data}, create_uris});
+      send_allocations += (target.empty() ? 0 : 1) + (data.empty() ? 0 : 1);
+    }
+  }
+  else {
+    //The latest value wins
+    PendingUpdate& pu = pending[pending_slots[slot] - 1];
+    if (pu.update.time <= time) {
+      pu.update.time = time;
+      if (movable) {
+        pu.update.data = std::move(data);
       }
       else {
-        //Find if any patterns match this information
-        if (std::any_of(on_demand_on[alias].begin(), on_demand_on[alias].end(),
-              [&](const OnDemandArgs& ta) {
-              if (not ta.valid) { return false;}
-              regmatch_t pmatch;
-              int match = regexec(&ta.exp, toString(I->target).c_str(), 1, &pmatch, 0);
-              return (0 == match and 0 == pmatch.rm_so and I->target.size() == pmatch.rm_eo); })) {
-          SolutionData sd{alias, I->time, I->target, I->data};
-          sds.push_back(sd);
+        if (pu.update.data.capacity() < data.size()) {
+          ++send_allocations;
         }
+        pu.update.data = data;
+      }
+      pu.create_uris = create_uris;
+    }
+  }
+}
+
+void SolverWorldModel::coalesceThread() {
+  std::unique_lock<std::mutex> lck(trans_mutex);
+  while (0 < coalesce_window) {
+    coalesce_cv.wait_for(lck, std::chrono::milliseconds(coalesce_window));
+    lck.unlock();
+    try {
+      flush();
+    }
+    catch (std::runtime_error& err) {
+      //Only happens while the solver is being destroyed
+      std::cerr<<"Dropping coalesced updates: "<<err.what()<<'\n';
+    }
+    lck.lock();
+  }
+}
+
+void SolverWorldModel::encodeSolutionMsg(bool create_uris, const std::vector<AliasedUpdate>& updates, GatherFrame& frame) {
+  //Same layout as world_model::solver::makeSolutionMsg: length, message ID,
+  //create_uris flag, and the number of solutions followed by each solution's
+  //alias, time, sized UTF16 target, and sized data.
+  size_t total = 4 + 1 + 1 + 4;
+  size_t header_size = total;
+  for (const AliasedUpdate& au : updates) {
+    size_t fields = 4 + 8 + 4 + 2 * au.target->size() + 4;
+    total += fields + au.data->size();
+    header_size += fields + (au.data->size() < gather_threshold ? au.data->size() : 0);
+  }
+  //Size the header buffer once so that the pieces can point into it
+  frame.headers.resize(header_size);
+  frame.pieces.clear();
+  frame.size = total;
+  unsigned char* out = frame.headers.data();
+  unsigned char* run_start = out;
+  writeNetOrder<uint32_t>(out, total - 4);
+  writeNetOrder<uint8_t>(out, (uint8_t)world_model::solver::MessageID::solver_data);
+  writeNetOrder<uint8_t>(out, create_uris ? 1 : 0);
+  writeNetOrder<uint32_t>(out, updates.size());
+  for (const AliasedUpdate& au : updates) {
+    writeNetOrder<uint32_t>(out, au.alias);
+    writeNetOrder<uint64_t>(out, au.time);
+    writeNetOrder<uint32_t>(out, 2 * au.target->size());
+    for (char16_t c : *au.target) {
+      writeNetOrder<uint16_t>(out, c);
+    }
+    writeNetOrder<uint32_t>(out, au.data->size());
+    if (au.data->size() < gather_threshold) {
+      out = std::copy(au.data->begin(), au.data->end(), out);
+    }
+    else {
+      //End the current run of header bytes and reference the payload
+      frame.pieces.push_back(iovec{run_start, (size_t)(out - run_start)});
+      frame.pieces.push_back(iovec{(void*)au.data->data(), au.data->size()});
+      run_start = out;
+    }
+  }
+  if (out != run_start) {
+    frame.pieces.push_back(iovec{run_start, (size_t)(out - run_start)});
+  }
+}
+
+std::unique_ptr<SolverWorldModel::OutgoingFrame> SolverWorldModel::acquireFrame() {
+  {
+    std::unique_lock<std::mutex> lck(pool_mutex);
+    if (not frame_pool.empty()) {
+      std::unique_ptr<OutgoingFrame> frame = std::move(frame_pool.back());
+      frame_pool.pop_back();
+      return frame;
+    }
+  }
+  ++send_allocations;
+  return std::unique_ptr<OutgoingFrame>(new OutgoingFrame());
+}
+
+void SolverWorldModel::releaseFrame(std::unique_ptr<OutgoingFrame> frame) {
+  //Buffers keep their capacity for the next message
+  frame->updates.clear();
+  std::unique_lock<std::mutex> lck(pool_mutex);
+  frame_pool.push_back(std::move(frame));
+}
+
+void SolverWorldModel::sendSolutions(OutgoingFrame& frame, bool create_uris) {
+  size_t header_capacity = frame.gather.headers.capacity();
+  size_t piece_capacity = frame.gather.pieces.capacity();
+  auto encode_start = std::chrono::steady_clock::now();
+  encodeSolutionMsg(create_uris, frame.updates, frame.gather);
+  encode.record(elapsedNanoseconds(encode_start));
+  if (header_capacity != frame.gather.headers.capacity() or
+      piece_capacity != frame.gather.pieces.capacity()) {
+    ++send_allocations;
+  }
+  //Empty messages only serve as keep alives and are not worth journaling
+  bool journaled = journal and not frame.updates.empty();
+  SolutionJournal::RecordID record = 0;
+  if (journaled) {
+    try {
+      uint64_t segments = journal->segmentsCreated();
+      record = journal->append(frame.gather.pieces.data(), frame.gather.pieces.size());
+      journal->commit();
+      send_allocations += journal->segmentsCreated() - segments;
+    }
+    catch (std::runtime_error& err) {
+      //Still send the solutions, they just will not survive a restart
+      std::cerr<<"Solutions were not journaled: "<<err.what()<<'\n';
+      journaled = false;
+    }
+  }
+
+  SendLock lck = lockSend();
+  sendAndReconnect(frame.gather.pieces.data(), frame.gather.pieces.size());
+  if (journaled) {
+    journal->release(record);
+  }
+}
+
+uint32_t SolverWorldModel::aliasOf(const AttrUpdate& update) {
+  auto I = aliases.find(update.type);
+  return I == aliases.end() ? 0 : I->second;
+}
+
+uint32_t SolverWorldModel::aliasOf(const HandleUpdate& update) {
+  //Handles are the type aliases, which are assigned in order starting at 1
+  return (0 < update.type and update.type <= types.size()) ? update.type : 0;
+}
+
+namespace {
+  //Access updates the same way whether a range holds updates or pointers
+  template<typename Update>
+  Update& deref(Update& update) {
+    return update;
+  }
+  template<typename Update>
+  Update& deref(Update* update) {
+    return *update;
+  }
+}
+
+template<typename Iterator>
+void SolverWorldModel::sendUpdates(Iterator begin, Iterator end, bool create_uris, bool movable) {
+  //Updates are encoded directly from the caller's vector
+  std::unique_ptr<OutgoingFrame> frame = acquireFrame();
+  size_t capacity = frame->updates.capacity();
+  {
+    std::unique_lock<std::mutex> lck(trans_mutex);
+    const OnDemandSnapshot& snapshot = *on_demand_snapshot;
+    for (Iterator I = begin; I != end; ++I) {
+      auto& update = deref(*I);
+      uint32_t alias = aliasOf(update);
+      if (0 == alias) {
+        continue;
       }
+      if (0 < coalesce_window) {
+        coalesce(alias, update.time, update.target, update.data, create_uris, movable);
+      }
+      else if (isRequested(snapshot, alias, update.target, &send_allocations) and
+          not (suppress_unchanged and isUnchanged(alias, update.target, update.time, update.data))) {
+        frame->updates.push_back(AliasedUpdate{alias, update.time, &update.target, &update.data});
+      }
+    }
+    //Coalesced updates are sent when the window closes
+    if (0 < coalesce_window) {
+      releaseFrame(std::move(frame));
+      return;
     }
   }
+  if (capacity != frame->updates.capacity()) {
+    ++send_allocations;
+  }
 
   //Allow sending an empty message (if all of the solutions are unrequested
   //on_demand solutions) to serve as a keep alive.
-  std::unique_lock<std::mutex> lck(send_mutex);
-  sendAndReconnect(world_model::solver::makeSolutionMsg(create_uris, sds));
+  sendSolutions(*frame, create_uris);
+  releaseFrame(std::move(frame));
+}
+
+void SolverWorldModel::sendData(std::vector<AttrUpdate>& solution, bool create_uris) {
+  sendUpdates(solution.begin(), solution.end(), create_uris, false);
+}
+
+void SolverWorldModel::sendData(std::vector<AttrUpdate>&& solution, bool create_uris) {
+  sendUpdates(solution.begin(), solution.end(), create_uris, true);
+}
+
+void SolverWorldModel::sendData(std::vector<HandleUpdate>& solution, bool create_uris) {
+  sendUpdates(solution.begin(), solution.end(), create_uris, false);
+}
+
+void SolverWorldModel::sendData(std::vector<HandleUpdate>&& solution, bool create_uris) {
+  sendUpdates(solution.begin(), solution.end(), create_uris, true);
+}
+
+uint64_t SolverWorldModel::sendAllocations() {
+  return send_allocations;
+}
+
+SolverWorldModel::TypeHandle SolverWorldModel::typeHandle(const std::u16string& type) {
+  std::unique_lock<std::mutex> lck(trans_mutex);
+  auto I = aliases.find(type);
+  return I == aliases.end() ? 0 : I->second;
+}
+
+void SolverWorldModel::coalesceUpdates(world_model::grail_time window) {
+  bool stop = false;
+  {
+    std::unique_lock<std::mutex> lck(trans_mutex);
+    bool was_coalescing = 0 < coalesce_window;
+    coalesce_window = std::max(window, (world_model::grail_time)0);
+    if (0 < coalesce_window and not was_coalescing) {
+      coalesce_thread = std::thread(&SolverWorldModel::coalesceThread, this);
+    }
+    else if (0 == coalesce_window and was_coalescing) {
+      stop = true;
+    }
+    coalesce_cv.notify_all();
+  }
+  if (stop) {
+    coalesce_thread.join();
+    //Send whatever was left in the last window
+    flush();
+  }
+}
+
+void SolverWorldModel::flush() {
+  //Windows must be sent in order so that older values never win
+  std::unique_lock<std::mutex> flush_lck(flush_mutex);
+  std::unique_ptr<OutgoingFrame> created = acquireFrame();
+  std::unique_ptr<OutgoingFrame> not_created = acquireFrame();
+  {
+    std::unique_lock<std::mutex> lck(trans_mutex);
+    //Swapping keeps the capacity of both windows. A window whose send
+    //failed must not come back as pending.
+    flushing.clear();
+    flushing.swap(pending);
+    std::fill(pending_slots.begin(), pending_slots.end(), 0);
+    const OnDemandSnapshot& snapshot = *on_demand_snapshot;
+    for (PendingUpdate& pu : flushing) {
+      AttrUpdate& update = pu.update;
+      if (isRequested(snapshot, pu.alias, update.target, &send_allocations) and
+          not (suppress_unchanged and isUnchanged(pu.alias, update.target, update.time, update.data))) {
+        (pu.create_uris ? created : not_created)->updates.push_back(AliasedUpdate{pu.alias, update.time, &update.target, &update.data});
+      }
+    }
+  }
+  if (not created->updates.empty()) {
+    sendSolutions(*created, true);
+  }
+  if (not not_created->updates.empty()) {
+    sendSolutions(*not_created, false);
+  }
+  flushing.clear();
+  releaseFrame(std::move(created));
+  releaseFrame(std::move(not_created));
+}
+
+size_t SolverWorldModel::remapJournaled(std::vector<unsigned char>& message, const SolutionJournal::Context& context) {
+  std::map<uint32_t, std::u16string> names;
+  if (not context or not decodeTypeTable(*context, names)) {
+    std::cerr<<"Dropping a journaled solution message without a type table.\n";
+    return 0;
+  }
+  //Same layout that encodeSolutionMsg writes
+  size_t offset = 0;
+  uint32_t length = 0;
+  uint8_t message_id = 0;
+  uint8_t create_uris = 0;
+  uint32_t count = 0;
+  if (not readNetOrder(message, offset, length) or
+      not readNetOrder(message, offset, message_id) or
+      not readNetOrder(message, offset, create_uris) or
+      not readNetOrder(message, offset, count) or
+      (uint8_t)world_model::solver::MessageID::solver_data != message_id) {
+    std::cerr<<"Dropping a malformed journaled solution message.\n";
+    return 0;
+  }
+  std::vector<unsigned char> remapped;
+  remapped.reserve(message.size());
+  appendNetOrder<uint32_t>(remapped, 0);
+  appendNetOrder<uint8_t>(remapped, message_id);
+  appendNetOrder<uint8_t>(remapped, create_uris);
+  appendNetOrder<uint32_t>(remapped, 0);
+  size_t kept = 0;
+  size_t dropped = 0;
+  std::unique_lock<std::mutex> lck(trans_mutex);
+  for (uint32_t i = 0; i < count; ++i) {
+    size_t start = offset;
+    uint32_t alias = 0;
+    world_model::grail_time time = 0;
+    uint32_t target_bytes = 0;
+    uint32_t data_bytes = 0;
+    if (not readNetOrder(message, offset, alias) or
+        not readNetOrder(message, offset, time) or
+        not readNetOrder(message, offset, target_bytes) or
+        message.size() < offset + target_bytes) {
+      std::cerr<<"Dropping a malformed journaled solution message.\n";
+      return 0;
+    }
+    offset += target_bytes;
+    if (not readNetOrder(message, offset, data_bytes) or message.size() < offset + data_bytes) {
+      std::cerr<<"Dropping a malformed journaled solution message.\n";
+      return 0;
+    }
+    offset += data_bytes;
+    //Aliases depend on the order types were added, so match them by name
+    auto name = names.find(alias);
+    auto current = name == names.end() ? aliases.end() : aliases.find(name->second);
+    if (aliases.end() == current) {
+      ++dropped;
+      continue;
+    }
+    appendNetOrder<uint32_t>(remapped, current->second);
+    remapped.insert(remapped.end(), message.begin() + start + 4, message.begin() + offset);
+    ++kept;
+  }
+  lck.unlock();
+  if (0 < dropped) {
+    std::cerr<<"Dropping "<<dropped<<" journaled solutions of types that are not registered.\n";
+  }
+  unsigned char* out = remapped.data();
+  writeNetOrder<uint32_t>(out, remapped.size() - 4);
+  out += 2;
+  writeNetOrder<uint32_t>(out, kept);
+  message.swap(remapped);
+  return kept;
+}
+
+bool SolverWorldModel::journalSolutions(const std::string& directory) {
+  std::unique_ptr<SolutionJournal> j(new SolutionJournal(directory));
+  if (not *j) {
+    std::cerr<<"Solutions will not be journaled.\n";
+    return false;
+  }
+  //Send anything left over from a previous run before any new solutions
+  std::vector<SolutionJournal::UnsentRecord> unsent = j->unsent();
+  if (not unsent.empty()) {
+    std::cerr<<"Resending "<<unsent.size()<<" journaled solution messages.\n";
+  }
+  {
+    SendLock lck = lockSend();
+    for (SolutionJournal::UnsentRecord& record : unsent) {
+      if (0 < remapJournaled(record.message, record.context)) {
+        sendAndReconnect(record.message);
+      }
+      j->release(record.id);
+    }
+  }
+  //Record the aliases of this run ahead of its messages. addTypes keeps
+  //the table current from now on.
+  std::unique_lock<std::mutex> lck(trans_mutex);
+  j->setContext(encodeTypeTable(types));
+  journal = std::move(j);
+  return true;
 }
 
 void SolverWorldModel::createURI(world_model::URI uri, world_model::grail_time created) {
-  std::unique_lock<std::mutex> lck(send_mutex);
-  sendAndReconnect(world_model::solver::makeCreateURI(uri, created, origin));
+  sendControl([&](std::vector<unsigned char>& buff) {
+      encodeURIOperation(buff, URIOperation::Kind::create_uri, uri, std::u16string(), created, origin);
+    });
 }
 
 void SolverWorldModel::expireURI(world_model::URI uri, world_model::grail_time expires) {
-  std::unique_lock<std::mutex> lck(send_mutex);
-  sendAndReconnect(world_model::solver::makeExpireURI(uri, expires, origin));
+  forgetSent(uri);
+  sendControl([&](std::vector<unsigned char>& buff) {
+      encodeURIOperation(buff, URIOperation::Kind::expire_uri, uri, std::u16string(), expires, origin);
+    });
 }
 
 void SolverWorldModel::deleteURI(world_model::URI uri) {
-  std::unique_lock<std::mutex> lck(send_mutex);
-  sendAndReconnect(world_model::solver::makeDeleteURI(uri, origin));
+  forgetSent(uri);
+  sendControl([&](std::vector<unsigned char>& buff) {
+      encodeURIOperation(buff, URIOperation::Kind::delete_uri, uri, std::u16string(), 0, origin);
+    });
 }
 
 void SolverWorldModel::expireURIAttribute(world_model::URI uri, std::u16string name, world_model::grail_time expires) {
-  std::unique_lock<std::mutex> lck(send_mutex);
-  sendAndReconnect(world_model::solver::makeExpireAttribute(uri, name, origin, expires));
+  forgetSent(uri, &name);
+  sendControl([&](std::vector<unsigned char>& buff) {
+      encodeURIOperation(buff, URIOperation::Kind::expire_attribute, uri, name, expires, origin);
+    });
 }
 
 void SolverWorldModel::deleteURIAttribute(world_model::URI uri, std::u16string name) {
-  std::unique_lock<std::mutex> lck(send_mutex);
-  sendAndReconnect(world_model::solver::makeDeleteAttribute(uri, name, origin));
+  forgetSent(uri, &name);
+  sendControl([&](std::vector<unsigned char>& buff) {
+      encodeURIOperation(buff, URIOperation::Kind::delete_attribute, uri, name, 0, origin);
+    });
 }
 
+void SolverWorldModel::sendURIOperations(const std::vector<URIOperation>& operations) {
+  typedef URIOperation::Kind Kind;
+  if (operations.empty()) {
+    return;
+  }
+  {
+    //Forget the values sent for the whole batch under one lock
+    std::unique_lock<std::mutex> lck(trans_mutex);
+    for (const URIOperation& op : operations) {
+      if (Kind::expire_uri == op.kind or Kind::delete_uri == op.kind) {
+        eraseSent(op.uri, nullptr);
+      }
+      else if (Kind::expire_attribute == op.kind or Kind::delete_attribute == op.kind) {
+        eraseSent(op.uri, &op.name);
+      }
+    }
+  }
+  //Messages are self delimiting so they are encoded back to back into one
+  //pooled buffer and written with a single send
+  sendControl([&](std::vector<unsigned char>& buff) {
+      for (const URIOperation& op : operations) {
+        encodeURIOperation(buff, op.kind, op.uri, op.name, op.time, origin);
+      }
+    });
+}
+
+/*******************************************************************************
+ * Functions for ShardedSolverWorldModel
+ ******************************************************************************/
+ShardedSolverWorldModel::ShardedSolverWorldModel(std::string ip, uint16_t port,
+    std::vector<std::pair<std::u16string, bool>>& types, std::u16string origin, size_t connections) {
+  for (size_t i = 0; i < std::max(connections, (size_t)1); ++i) {
+    shards.push_back(std::unique_ptr<SolverWorldModel>(new SolverWorldModel(ip, port, types, origin)));
+  }
+}
+
+ShardedSolverWorldModel::ShardedSolverWorldModel(const std::vector<SolverWorldModel::Endpoint>& endpoints,
+    std::vector<std::pair<std::u16string, bool>>& types, std::u16string origin, size_t connections) {
+  for (size_t i = 0; i < std::max(connections, (size_t)1); ++i) {
+    shards.push_back(std::unique_ptr<SolverWorldModel>(new SolverWorldModel(endpoints, types, origin)));
+  }
+}
 
+size_t ShardedSolverWorldModel::shardFor(const world_model::URI& uri) const {
+  return std::hash<world_model::URI>()(uri) % shards.size();
+}
+
+SolverWorldModel& ShardedSolverWorldModel::shard(size_t index) {
+  return *shards.at(index);
+}
+
+size_t ShardedSolverWorldModel::size() const {
+  return shards.size();
+}
+
+bool ShardedSolverWorldModel::connected() {
+  return std::all_of(shards.begin(), shards.end(),
+      [](std::unique_ptr<SolverWorldModel>& swm) { return swm->connected();});
+}
+
+bool ShardedSolverWorldModel::waitForConnection(world_model::grail_time timeout) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  for (auto& swm : shards) {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now()).count();
+    if (not swm->waitForConnection(std::max<world_model::grail_time>(remaining, 0))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::vector<ShardedSolverWorldModel::TypeHandle> ShardedSolverWorldModel::addTypes(std::vector<std::pair<std::u16string, bool>>& new_types) {
+  //Every shard assigns the same aliases since they announce the same types
+  std::vector<TypeHandle> handles;
+  for (auto& swm : shards) {
+    handles = swm->addTypes(new_types);
+  }
+  return handles;
+}
+
+ShardedSolverWorldModel::TypeHandle ShardedSolverWorldModel::typeHandle(const std::u16string& type) {
+  return shards.front()->typeHandle(type);
+}
+
+bool ShardedSolverWorldModel::isRequested(const std::u16string& type, const world_model::URI& uri) {
+  return shards[shardFor(uri)]->isRequested(type, uri);
+}
+
+bool ShardedSolverWorldModel::isRequested(TypeHandle type, const world_model::URI& uri) {
+  return shards[shardFor(uri)]->isRequested(type, uri);
+}
+
+template<typename Update>
+void ShardedSolverWorldModel::sendUpdates(std::vector<Update>& solution, bool create_uris, bool movable) {
+  std::vector<std::vector<Update*>> partitions(shards.size());
+  for (Update& update : solution) {
+    partitions[shardFor(update.target)].push_back(&update);
+  }
+  //Starting threads costs more than sending a small batch
+  bool parallel = solution.size() >= parallel_threshold;
+  std::vector<std::future<void>> sends;
+  for (size_t i = 0; i < shards.size(); ++i) {
+    if (partitions[i].empty()) {
+      continue;
+    }
+    SolverWorldModel* swm = shards[i].get();
+    std::vector<Update*>* partition = &partitions[i];
+    if (parallel) {
+      sends.push_back(std::async(std::launch::async,
+            [=]() { swm->sendUpdates(partition->begin(), partition->end(), create_uris, movable);}));
+    }
+    else {
+      swm->sendUpdates(partition->begin(), partition->end(), create_uris, movable);
+    }
+  }
+  //Wait for every shard (rethrowing any errors)
+  for (std::future<void>& f : sends) {
+    f.get();
+  }
+}
+
+void ShardedSolverWorldModel::sendData(std::vector<AttrUpdate>& solution, bool create_uris) {
+  sendUpdates(solution, create_uris, false);
+}
+
+void ShardedSolverWorldModel::sendData(std::vector<AttrUpdate>&& solution, bool create_uris) {
+  sendUpdates(solution, create_uris, true);
+}
+
+void ShardedSolverWorldModel::sendData(std::vector<HandleUpdate>& solution, bool create_uris) {
+  sendUpdates(solution, create_uris, false);
+}
+
+void ShardedSolverWorldModel::sendData(std::vector<HandleUpdate>&& solution, bool create_uris) {
+  sendUpdates(solution, create_uris, true);
+}
+
+void ShardedSolverWorldModel::createURI(world_model::URI uri, world_model::grail_time created) {
+  shards[shardFor(uri)]->createURI(uri, created);
+}
+
+void ShardedSolverWorldModel::expireURI(world_model::URI uri, world_model::grail_time expires) {
+  shards[shardFor(uri)]->expireURI(uri, expires);
+}
+
+void ShardedSolverWorldModel::deleteURI(world_model::URI uri) {
+  shards[shardFor(uri)]->deleteURI(uri);
+}
+
+void ShardedSolverWorldModel::expireURIAttribute(world_model::URI uri, std::u16string name, world_model::grail_time expires) {
+  shards[shardFor(uri)]->expireURIAttribute(uri, name, expires);
+}
+
+void ShardedSolverWorldModel::deleteURIAttribute(world_model::URI uri, std::u16string name) {
+  shards[shardFor(uri)]->deleteURIAttribute(uri, name);
+}
+
+void ShardedSolverWorldModel::sendURIOperations(const std::vector<URIOperation>& operations) {
+  std::vector<std::vector<URIOperation>> partitions(shards.size());
+  for (const URIOperation& op : operations) {
+    partitions[shardFor(op.uri)].push_back(op);
+  }
+  for (size_t i = 0; i < shards.size(); ++i) {
+    shards[i]->sendURIOperations(partitions[i]);
+  }
+}